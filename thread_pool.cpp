@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "thread_pool.hpp"
+
+namespace tokenize_py
+{
+
+	void parallel_for(size_t count, size_t threads, const std::function<void(size_t)>& task)
+	{
+		if (threads == 0)
+			threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+		threads = std::min(threads, count);
+		if (threads <= 1) {
+			for (size_t i = 0; i < count; ++i)
+				task(i);
+			return;
+		}
+
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<size_t> tasks;
+		};
+		std::vector<Queue> queues(threads);
+		for (size_t i = 0; i < count; ++i)
+			queues[i % threads].tasks.push_back(i);
+
+		// Owners take from the back of their own queue and thieves from the
+		// front of someone else's. No tasks are added once the threads have
+		// started, so when every queue is empty the work is done.
+		auto worker = [&](size_t self) {
+			for (;;) {
+				size_t i = 0;
+				bool found = false;
+				for (size_t k = 0; k < threads && !found; ++k) {
+					auto& queue = queues[(self + k) % threads];
+					std::lock_guard<std::mutex> lock(queue.mutex);
+					if (queue.tasks.empty())
+						continue;
+					if (k == 0) {
+						i = queue.tasks.back();
+						queue.tasks.pop_back();
+					}
+					else {
+						i = queue.tasks.front();
+						queue.tasks.pop_front();
+					}
+					found = true;
+				}
+				if (!found)
+					return;
+				task(i);
+			}
+		};
+
+		std::vector<std::thread> pool;
+		for (size_t t = 1; t < threads; ++t)
+			pool.emplace_back(worker, t);
+		worker(0);
+		for (auto& thread : pool)
+			thread.join();
+	}
+
+}
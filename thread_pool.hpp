@@ -0,0 +1,17 @@
+#pragma once
+
+// Work stealing parallel loop used by the batch tokenization functions
+// Written by Dominic Price 2021, see the LICENCE file
+
+#include <cstddef>
+#include <functional>
+
+namespace tokenize_py
+{
+	// Calls task(i) for every i in [0, count) using up to the given number
+	// of threads, or one per hardware thread if it is zero, and returns once
+	// they have all finished. Each thread starts with an equal share of the
+	// indices and steals from the others once its own share runs out, so a
+	// few long running tasks don't hold up the rest. The task must not throw.
+	void parallel_for(size_t count, size_t threads, const std::function<void(size_t)>& task);
+} // namespace tokenize_py
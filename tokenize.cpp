@@ -1,20 +1,31 @@
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 #include "tokenize.hpp"
+#include "thread_pool.hpp"
+#include "unicode.hpp"
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace tokenize_py
 {
 
 	namespace helpers
 	{
-		std::string repeat(const std::string& s, size_t n)
-		{
-			std::string ret;
-			while (n--)
-				ret += s;
-			return ret;
-		}
-
-
 		std::string to_lower(std::string s)
 		{
 			std::transform(s.begin(), s.end(), s.begin(), ::tolower);
@@ -40,41 +51,163 @@ namespace tokenize_py
 		}
 
 
-		bool starts_with(const std::string& s, const std::string& prefix)
+		bool starts_with(std::string_view s, std::string_view prefix)
 		{
-			return s.rfind(prefix, 0) == 0;
+			return s.substr(0, prefix.size()) == prefix;
 		}
 
 
-		bool ends_with(const std::string& s, const std::string& postfix)
+		bool ends_with(std::string_view s, std::string_view postfix)
+		{
+			return s.size() >= postfix.size() && s.substr(s.size() - postfix.size()) == postfix;
+		}
+
+		std::string_view lstrip(std::string_view s, std::string_view chars)
 		{
-			auto pos = s.size() - postfix.size();
-			return s.find(postfix, pos) == pos;
+			while (!s.empty() && chars.find(s.front()) != std::string_view::npos)
+				s.remove_prefix(1);
+			return s;
 		}
 
-		std::string rstrip(std::string s, const std::string& chars)
+		std::string_view rstrip(std::string_view s, std::string_view chars)
 		{
-			while (!s.empty() && chars.find(s.back()) != std::string::npos)
-				s.pop_back();
+			while (!s.empty() && chars.find(s.back()) != std::string_view::npos)
+				s.remove_suffix(1);
 			return s;
 		}
 
-		template <typename Container = std::initializer_list<std::string>>
-		std::string join(const std::string& delim, const Container& choices)
+		uint64_t mix(uint64_t x)
+		{
+			x ^= x >> 33;
+			x *= 0xff51afd7ed558ccdull;
+			x ^= x >> 33;
+			x *= 0xc4ceb9fe1a85ec53ull;
+			x ^= x >> 33;
+			return x;
+		}
+
+		// A fast 64 bit hash of a buffer read eight bytes at a time, which
+		// isn't meant to be hard to find collisions for
+		uint64_t hash(std::string_view s)
+		{
+			const uint64_t k = 0x9e3779b97f4a7c15ull;
+			uint64_t h = s.size() * k;
+			size_t i = 0;
+			for (; i + 8 <= s.size(); i += 8) {
+				uint64_t word;
+				std::memcpy(&word, s.data() + i, 8);
+				h = (h ^ mix(word)) * k;
+			}
+			uint64_t word = 0;
+			std::memcpy(&word, s.data() + i, s.size() - i);
+			return mix((h ^ mix(word)) * k);
+		}
+
+		// Read only view of a whole file mapped into memory
+		class MappedFile
+		{
+		public:
+			explicit MappedFile(const std::string& path);
+			MappedFile(const MappedFile&) = delete;
+			MappedFile& operator = (const MappedFile&) = delete;
+			~MappedFile();
+
+			std::string_view view() const;
+
+		private:
+			const char* data;
+			size_t size;
+#ifdef _WIN32
+			HANDLE mapping;
+#endif
+		};
+
+#ifdef _WIN32
+		MappedFile::MappedFile(const std::string& path)
+			: data(nullptr)
+			, size(0)
+			, mapping(nullptr)
+		{
+			HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+				OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (file == INVALID_HANDLE_VALUE)
+				throw std::runtime_error("could not open " + path);
+			LARGE_INTEGER file_size;
+			if (!GetFileSizeEx(file, &file_size)) {
+				CloseHandle(file);
+				throw std::runtime_error("could not read the size of " + path);
+			}
+			size = static_cast<size_t>(file_size.QuadPart);
+			if (size) {
+				mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (mapping)
+					data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			}
+			CloseHandle(file);
+			if (size && !data) {
+				if (mapping)
+					CloseHandle(mapping);
+				throw std::runtime_error("could not map " + path);
+			}
+		}
+
+		MappedFile::~MappedFile()
+		{
+			if (data)
+				UnmapViewOfFile(data);
+			if (mapping)
+				CloseHandle(mapping);
+		}
+#else
+		MappedFile::MappedFile(const std::string& path)
+			: data(nullptr)
+			, size(0)
+		{
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw std::runtime_error("could not open " + path);
+			struct stat st;
+			if (fstat(fd, &st) != 0) {
+				close(fd);
+				throw std::runtime_error("could not read the size of " + path);
+			}
+			size = static_cast<size_t>(st.st_size);
+			if (size) {
+				void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (addr == MAP_FAILED) {
+					close(fd);
+					throw std::runtime_error("could not map " + path);
+				}
+				madvise(addr, size, MADV_SEQUENTIAL);
+				data = static_cast<const char*>(addr);
+			}
+			close(fd);
+		}
+
+		MappedFile::~MappedFile()
+		{
+			if (data)
+				munmap(const_cast<char*>(data), size);
+		}
+#endif
+
+		std::string_view MappedFile::view() const
+		{
+			return std::string_view(data, size);
+		}
+
+		// Throws an error in the source as the exception tokenize() throws
+		[[noreturn]] void raise(const Diagnostic& diagnostic)
 		{
-			std::string res;
-			if (choices.size() == 0)
-				return res;
-			for (size_t i = 0; i < choices.size() - 1; ++i)
-				res += *(choices.begin() + i) + delim;
-			return res + *(choices.begin() + choices.size() - 1);
+			if (diagnostic.kind == Diagnostic::BAD_DEDENT)
+				throw std::runtime_error(diagnostic.message);
+			throw TokenError(diagnostic.message, diagnostic.position);
 		}
 	}
 
-	// from token import tok_name, EXACT_TOKEN_TYPES
-	// print("const std::unordered_map<std::string, Token> exact_token_types = { ", end='')
-	// print(", ".join(f'{{ "{key}", {tok_name[val]} }}' for key, val in EXACT_TOKEN_TYPES.items()), end = ' };\n')
-	const std::unordered_map<std::string, Token> exact_token_types = { { "!=", NOTEQUAL }, { "%", PERCENT }, { "%=", PERCENTEQUAL }, { "&", AMPER }, { "&=", AMPEREQUAL }, { "(", LPAR }, { ")", RPAR }, { "*", STAR }, { "**", DOUBLESTAR }, { "**=", DOUBLESTAREQUAL }, { "*=", STAREQUAL }, { "+", PLUS }, { "+=", PLUSEQUAL }, { ",", COMMA }, { "-", MINUS }, { "-=", MINEQUAL }, { "->", RARROW }, { ".", DOT }, { "...", ELLIPSIS }, { "/", SLASH }, { "//", DOUBLESLASH }, { "//=", DOUBLESLASHEQUAL }, { "/=", SLASHEQUAL }, { ":", COLON }, { ":=", COLONEQUAL }, { ";", SEMI }, { "<", LESS }, { "<<", LEFTSHIFT }, { "<<=", LEFTSHIFTEQUAL }, { "<=", LESSEQUAL }, { "=", EQUAL }, { "==", EQEQUAL }, { ">", GREATER }, { ">=", GREATEREQUAL }, { ">>", RIGHTSHIFT }, { ">>=", RIGHTSHIFTEQUAL }, { "@", AT }, { "@=", ATEQUAL }, { "[", LSQB }, { "]", RSQB }, { "^", CIRCUMFLEX }, { "^=", CIRCUMFLEXEQUAL }, { "{", LBRACE }, { "|", VBAR }, { "|=", VBAREQUAL }, { "}", RBRACE }, { "~", TILDE } };
+	// The tables below are only read once they have been initialised, so
+	// they are shared between threads tokenizing in parallel without any
+	// locking. All other state lives in the Tokenizer.
 
 	// from token import tok_name
 	// print("std::string to_string(Token token)\n{")
@@ -87,36 +220,742 @@ namespace tokenize_py
         switch (token) { case ENDMARKER: return "ENDMARKER"; case NAME: return "NAME"; case NUMBER: return "NUMBER"; case STRING: return "STRING"; case NEWLINE: return "NEWLINE"; case INDENT: return "INDENT"; case DEDENT: return "DEDENT"; case LPAR: return "LPAR"; case RPAR: return "RPAR"; case LSQB: return "LSQB"; case RSQB: return "RSQB"; case COLON: return "COLON"; case COMMA: return "COMMA"; case SEMI: return "SEMI"; case PLUS: return "PLUS"; case MINUS: return "MINUS"; case STAR: return "STAR"; case SLASH: return "SLASH"; case VBAR: return "VBAR"; case AMPER: return "AMPER"; case LESS: return "LESS"; case GREATER: return "GREATER"; case EQUAL: return "EQUAL"; case DOT: return "DOT"; case PERCENT: return "PERCENT"; case LBRACE: return "LBRACE"; case RBRACE: return "RBRACE"; case EQEQUAL: return "EQEQUAL"; case NOTEQUAL: return "NOTEQUAL"; case LESSEQUAL: return "LESSEQUAL"; case GREATEREQUAL: return "GREATEREQUAL"; case TILDE: return "TILDE"; case CIRCUMFLEX: return "CIRCUMFLEX"; case LEFTSHIFT: return "LEFTSHIFT"; case RIGHTSHIFT: return "RIGHTSHIFT"; case DOUBLESTAR: return "DOUBLESTAR"; case PLUSEQUAL: return "PLUSEQUAL"; case MINEQUAL: return "MINEQUAL"; case STAREQUAL: return "STAREQUAL"; case SLASHEQUAL: return "SLASHEQUAL"; case PERCENTEQUAL: return "PERCENTEQUAL"; case AMPEREQUAL: return "AMPEREQUAL"; case VBAREQUAL: return "VBAREQUAL"; case CIRCUMFLEXEQUAL: return "CIRCUMFLEXEQUAL"; case LEFTSHIFTEQUAL: return "LEFTSHIFTEQUAL"; case RIGHTSHIFTEQUAL: return "RIGHTSHIFTEQUAL"; case DOUBLESTAREQUAL: return "DOUBLESTAREQUAL"; case DOUBLESLASH: return "DOUBLESLASH"; case DOUBLESLASHEQUAL: return "DOUBLESLASHEQUAL"; case AT: return "AT"; case ATEQUAL: return "ATEQUAL"; case RARROW: return "RARROW"; case ELLIPSIS: return "ELLIPSIS"; case COLONEQUAL: return "COLONEQUAL"; case OP: return "OP"; case AWAIT: return "AWAIT"; case ASYNC: return "ASYNC"; case TYPE_IGNORE: return "TYPE_IGNORE"; case TYPE_COMMENT: return "TYPE_COMMENT"; case ERRORTOKEN: return "ERRORTOKEN"; case COMMENT: return "COMMENT"; case NL: return "NL"; case ENCODING: return "ENCODING"; case N_TOKENS: return "N_TOKENS"; case NT_OFFSET: return "NT_OFFSET"; default: throw std::runtime_error("Unrecognised token " + std::to_string(token)); }
 	}
 
-	// from tokenize import PseudoToken, endpats, single_quoted, triple_quoted
-	// delim = "esc"
-	// rs = f'R"{delim}('
-	// re = f'){delim}"'
-	// print(f'const std::string PseudoToken = {rs}{PseudoToken}{re};')
-	const std::string PseudoToken = R"esc([ \f\t]*((\\\r?\n|\Z|#[^\r\n]*|((|U|R|F|RF|rF|f|Rb|fR|b|bR|BR|B|Fr|rB|fr|Rf|RB|rb|u|rf|r|br|Br|FR)'''|(|U|R|F|RF|rF|f|Rb|fR|b|bR|BR|B|Fr|rB|fr|Rf|RB|rb|u|rf|r|br|Br|FR)"""))|(([0-9](?:_?[0-9])*[jJ]|(([0-9](?:_?[0-9])*\.(?:[0-9](?:_?[0-9])*)?|\.[0-9](?:_?[0-9])*)([eE][-+]?[0-9](?:_?[0-9])*)?|[0-9](?:_?[0-9])*[eE][-+]?[0-9](?:_?[0-9])*)[jJ])|(([0-9](?:_?[0-9])*\.(?:[0-9](?:_?[0-9])*)?|\.[0-9](?:_?[0-9])*)([eE][-+]?[0-9](?:_?[0-9])*)?|[0-9](?:_?[0-9])*[eE][-+]?[0-9](?:_?[0-9])*)|(0[xX](?:_?[0-9a-fA-F])+|0[bB](?:_?[01])+|0[oO](?:_?[0-7])+|(?:0(?:_?0)*|[1-9](?:_?[0-9])*)))|(\r?\n|(\~|\}|\|=|\||\{|\^=|\^|\]|\[|@=|@|>>=|>>|>=|>|==|=|<=|<<=|<<|<|;|:=|:|/=|//=|//|/|\.\.\.|\.|\->|\-=|\-|,|\+=|\+|\*=|\*\*=|\*\*|\*|\)|\(|\&=|\&|%=|%|!=))|((|U|R|F|RF|rF|f|Rb|fR|b|bR|BR|B|Fr|rB|fr|Rf|RB|rb|u|rf|r|br|Br|FR)'[^\n'\\]*(?:\\.[^\n'\\]*)*('|\\\r?\n)|(|U|R|F|RF|rF|f|Rb|fR|b|bR|BR|B|Fr|rB|fr|Rf|RB|rb|u|rf|r|br|Br|FR)"[^\n"\\]*(?:\\.[^\n"\\]*)*("|\\\r?\n))|\w+))esc";
-	// print('const std::unordered_map<std::string, std::string> endpats = {', end='')
-	// print(', '.join(f'{{ {rs}{key}{re}, {rs}{val}{re} }}' for key, val in endpats.items()), end='')
-	// print('};')
-	const std::unordered_map<std::string, std::string> endpats = { { R"esc(')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(U')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(U")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(U''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(U""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(R')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(R")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(R''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(R""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(F')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(F")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(F''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(F""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(RF')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(RF")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(RF''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(RF""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(rF')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(rF")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(rF''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(rF""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(f')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(f")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(f''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(f""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(Rb')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(Rb")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(Rb''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(Rb""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(fR')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(fR")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(fR''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(fR""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(b')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(b")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(b''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(b""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(bR')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(bR")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(bR''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(bR""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(BR')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(BR")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(BR''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(BR""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(B')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(B")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(B''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(B""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(Fr')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(Fr")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(Fr''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(Fr""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(rB')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(rB")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(rB''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(rB""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(fr')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(fr")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(fr''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(fr""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(Rf')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(Rf")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(Rf''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(Rf""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(RB')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(RB")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(RB''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(RB""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(rb')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(rb")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(rb''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(rb""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(u')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(u")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(u''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(u""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(rf')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(rf")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(rf''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(rf""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(r')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(r")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(r''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(r""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(br')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(br")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(br''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(br""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(Br')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(Br")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(Br''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(Br""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" }, { R"esc(FR')esc", R"esc([^'\\]*(?:\\.[^'\\]*)*')esc" }, { R"esc(FR")esc", R"esc([^"\\]*(?:\\.[^"\\]*)*")esc" }, { R"esc(FR''')esc", R"esc([^'\\]*(?:(?:\\.|'(?!''))[^'\\]*)*''')esc" }, { R"esc(FR""")esc", R"esc([^"\\]*(?:(?:\\.|"(?!""))[^"\\]*)*""")esc" } };
-	// print('const std::unordered_set<std::string> single_quoted = {', end='')
-	// print(', '.join(f'{rs}{val}{re}' for val in single_quoted), end='')
-	// print('};')
-	const std::unordered_set<std::string> single_quoted = { R"esc(f")esc", R"esc(B")esc", R"esc(RB")esc", R"esc(rB")esc", R"esc(Rf")esc", R"esc(RF")esc", R"esc(rb')esc", R"esc(Br')esc", R"esc(Br")esc", R"esc(Fr')esc", R"esc(u')esc", R"esc(r')esc", R"esc(u")esc", R"esc(rF')esc", R"esc(')esc", R"esc(F')esc", R"esc(F")esc", R"esc(")esc", R"esc(R")esc", R"esc(rF")esc", R"esc(fR")esc", R"esc(bR")esc", R"esc(RF')esc", R"esc(Fr")esc", R"esc(fr")esc", R"esc(FR')esc", R"esc(r")esc", R"esc(Rb")esc", R"esc(Rb')esc", R"esc(bR')esc", R"esc(br')esc", R"esc(fr')esc", R"esc(R')esc", R"esc(b")esc", R"esc(BR")esc", R"esc(rf')esc", R"esc(f')esc", R"esc(br")esc", R"esc(B')esc", R"esc(rb")esc", R"esc(b')esc", R"esc(RB')esc", R"esc(BR')esc", R"esc(rB')esc", R"esc(FR")esc", R"esc(fR')esc", R"esc(U')esc", R"esc(rf")esc", R"esc(U")esc", R"esc(Rf')esc" };
-	// print('const std::unordered_set<std::string> triple_quoted = {', end='')
-	// print(', '.join(f'{rs}{val}{re}' for val in triple_quoted), end='')
-	// print('};')
-	const std::unordered_set<std::string> triple_quoted = { R"esc(br''')esc", R"esc(Br""")esc", R"esc(rB""")esc", R"esc(F""")esc", R"esc(RB''')esc", R"esc(b""")esc", R"esc(rF""")esc", R"esc(Rb""")esc", R"esc(fR""")esc", R"esc(Rb''')esc", R"esc(bR''')esc", R"esc(B""")esc", R"esc(rB''')esc", R"esc(u''')esc", R"esc(Br''')esc", R"esc(br""")esc", R"esc(f''')esc", R"esc(fR''')esc", R"esc(R""")esc", R"esc(rf""")esc", R"esc(RB""")esc", R"esc(Rf''')esc", R"esc(rf''')esc", R"esc(Rf""")esc", R"esc(''')esc", R"esc(rb""")esc", R"esc(b''')esc", R"esc(BR''')esc", R"esc(Fr""")esc", R"esc(fr''')esc", R"esc(bR""")esc", R"esc(r""")esc", R"esc(f""")esc", R"esc(B''')esc", R"esc(Fr''')esc", R"esc(""")esc", R"esc(FR''')esc", R"esc(BR""")esc", R"esc(RF""")esc", R"esc(FR""")esc", R"esc(rF''')esc", R"esc(F''')esc", R"esc(U''')esc", R"esc(rb''')esc", R"esc(u""")esc", R"esc(r''')esc", R"esc(U""")esc", R"esc(RF''')esc", R"esc(fr""")esc", R"esc(R''')esc" };
-
-	// FIXME: Not valid for Python3 identifier which are extended to include unicode
-	const std::string Identifier = R"esc([_a-z]\w*$)esc";
+	TokenMask token_mask(std::initializer_list<Token> types)
+	{
+		TokenMask mask;
+		for (auto type : types)
+			mask.set(type);
+		return mask;
+	}
 
 	const size_t tabsize = 8;
 
+	// Hand-written replacement for the PseudoToken regex of the python
+	// module:
+	//
+	//   PseudoToken = Whitespace + group(PseudoExtras, Number, Funny, ContStr, Name)
+	//
+	// Each alternative is tried in the same order as the regex so that the
+	// resulting spans are identical to re.match(PseudoToken, line, pos)
+	namespace scanner
+	{
+		const size_t npos = std::string_view::npos;
+
+		inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+		inline bool is_hex(char c) { return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'); }
+		inline bool is_bin(char c) { return c == '0' || c == '1'; }
+		inline bool is_oct(char c) { return c >= '0' && c <= '7'; }
+		inline bool is_word(char c) { return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+
+		// pred(?:_?pred)*
+		template <typename Pred>
+		size_t digitpart(std::string_view s, size_t p, Pred pred)
+		{
+			if (p >= s.size() || !pred(s[p]))
+				return npos;
+			++p;
+			while (p < s.size()) {
+				if (pred(s[p]))
+					++p;
+				else if (s[p] == '_' && p + 1 < s.size() && pred(s[p + 1]))
+					p += 2;
+				else
+					break;
+			}
+			return p;
+		}
+
+		// (?:_?pred)+
+		template <typename Pred>
+		size_t underscored(std::string_view s, size_t p, Pred pred)
+		{
+			if (p < s.size() && s[p] == '_')
+				++p;
+			return digitpart(s, p, pred);
+		}
+
+		// [eE][-+]?[0-9](?:_?[0-9])*
+		size_t exponent(std::string_view s, size_t p)
+		{
+			if (p >= s.size() || (s[p] != 'e' && s[p] != 'E'))
+				return npos;
+			++p;
+			if (p < s.size() && (s[p] == '-' || s[p] == '+'))
+				++p;
+			return digitpart(s, p, is_digit);
+		}
+
+		// group(Pointfloat, Expfloat)
+		size_t floatnumber(std::string_view s, size_t p)
+		{
+			size_t q = digitpart(s, p, is_digit);
+			size_t pointfloat = npos;
+			if (q != npos && q < s.size() && s[q] == '.') {
+				size_t frac = digitpart(s, q + 1, is_digit);
+				pointfloat = frac != npos ? frac : q + 1;
+			}
+			else if (q == npos && p < s.size() && s[p] == '.') {
+				pointfloat = digitpart(s, p + 1, is_digit);
+			}
+			if (pointfloat != npos) {
+				size_t e = exponent(s, pointfloat);
+				return e != npos ? e : pointfloat;
+			}
+			if (q != npos)
+				return exponent(s, q);
+			return npos;
+		}
+
+		// group(Hexnumber, Binnumber, Octnumber, Decnumber)
+		size_t intnumber(std::string_view s, size_t p)
+		{
+			if (p >= s.size())
+				return npos;
+			if (s[p] == '0' && p + 1 < s.size()) {
+				size_t q = npos;
+				switch (s[p + 1]) {
+				case 'x': case 'X': q = underscored(s, p + 2, is_hex); break;
+				case 'b': case 'B': q = underscored(s, p + 2, is_bin); break;
+				case 'o': case 'O': q = underscored(s, p + 2, is_oct); break;
+				}
+				if (q != npos)
+					return q;
+			}
+			if (s[p] == '0')
+				return digitpart(s, p, [](char c) { return c == '0'; });
+			if (s[p] >= '1' && s[p] <= '9')
+				return digitpart(s, p, is_digit);
+			return npos;
+		}
+
+		// group(Imagnumber, Floatnumber, Intnumber)
+		size_t number(std::string_view s, size_t p)
+		{
+			auto imag = [&](size_t q) {
+				return q != npos && q < s.size() && (s[q] == 'j' || s[q] == 'J') ? q + 1 : npos;
+			};
+			size_t q = imag(digitpart(s, p, is_digit));
+			if (q != npos)
+				return q;
+			size_t f = floatnumber(s, p);
+			if ((q = imag(f)) != npos)
+				return q;
+			if (f != npos)
+				return f;
+			return intnumber(s, p);
+		}
+
+		// Returns the length of the longest of EXACT_TOKEN_TYPES at the start
+		// of s and sets its type, or returns zero if there isn't one. This is
+		// a switch on each byte in turn, generated from the token module,
+		// which falls back to the longest operator matched so far.
+		size_t match_operator(std::string_view s, Token& type)
+		{
+			if (s.empty())
+				return 0;
+			switch (s[0]) {
+			case '!':
+				if (s.size() > 1 && s[1] == '=') {
+					type = NOTEQUAL;
+					return 2;
+				}
+				return 0;
+			case '%':
+				if (s.size() > 1 && s[1] == '=') {
+					type = PERCENTEQUAL;
+					return 2;
+				}
+				type = PERCENT;
+				return 1;
+			case '&':
+				if (s.size() > 1 && s[1] == '=') {
+					type = AMPEREQUAL;
+					return 2;
+				}
+				type = AMPER;
+				return 1;
+			case '(':
+				type = LPAR;
+				return 1;
+			case ')':
+				type = RPAR;
+				return 1;
+			case '*':
+				if (s.size() > 1) {
+					switch (s[1]) {
+					case '*':
+						if (s.size() > 2 && s[2] == '=') {
+							type = DOUBLESTAREQUAL;
+							return 3;
+						}
+						type = DOUBLESTAR;
+						return 2;
+					case '=':
+						type = STAREQUAL;
+						return 2;
+					}
+				}
+				type = STAR;
+				return 1;
+			case '+':
+				if (s.size() > 1 && s[1] == '=') {
+					type = PLUSEQUAL;
+					return 2;
+				}
+				type = PLUS;
+				return 1;
+			case ',':
+				type = COMMA;
+				return 1;
+			case '-':
+				if (s.size() > 1) {
+					switch (s[1]) {
+					case '=':
+						type = MINEQUAL;
+						return 2;
+					case '>':
+						type = RARROW;
+						return 2;
+					}
+				}
+				type = MINUS;
+				return 1;
+			case '.':
+				if (s.size() > 1 && s[1] == '.') {
+					if (s.size() > 2 && s[2] == '.') {
+						type = ELLIPSIS;
+						return 3;
+					}
+					type = DOT;
+					return 1;
+				}
+				type = DOT;
+				return 1;
+			case '/':
+				if (s.size() > 1) {
+					switch (s[1]) {
+					case '/':
+						if (s.size() > 2 && s[2] == '=') {
+							type = DOUBLESLASHEQUAL;
+							return 3;
+						}
+						type = DOUBLESLASH;
+						return 2;
+					case '=':
+						type = SLASHEQUAL;
+						return 2;
+					}
+				}
+				type = SLASH;
+				return 1;
+			case ':':
+				if (s.size() > 1 && s[1] == '=') {
+					type = COLONEQUAL;
+					return 2;
+				}
+				type = COLON;
+				return 1;
+			case ';':
+				type = SEMI;
+				return 1;
+			case '<':
+				if (s.size() > 1) {
+					switch (s[1]) {
+					case '<':
+						if (s.size() > 2 && s[2] == '=') {
+							type = LEFTSHIFTEQUAL;
+							return 3;
+						}
+						type = LEFTSHIFT;
+						return 2;
+					case '=':
+						type = LESSEQUAL;
+						return 2;
+					}
+				}
+				type = LESS;
+				return 1;
+			case '=':
+				if (s.size() > 1 && s[1] == '=') {
+					type = EQEQUAL;
+					return 2;
+				}
+				type = EQUAL;
+				return 1;
+			case '>':
+				if (s.size() > 1) {
+					switch (s[1]) {
+					case '=':
+						type = GREATEREQUAL;
+						return 2;
+					case '>':
+						if (s.size() > 2 && s[2] == '=') {
+							type = RIGHTSHIFTEQUAL;
+							return 3;
+						}
+						type = RIGHTSHIFT;
+						return 2;
+					}
+				}
+				type = GREATER;
+				return 1;
+			case '@':
+				if (s.size() > 1 && s[1] == '=') {
+					type = ATEQUAL;
+					return 2;
+				}
+				type = AT;
+				return 1;
+			case '[':
+				type = LSQB;
+				return 1;
+			case ']':
+				type = RSQB;
+				return 1;
+			case '^':
+				if (s.size() > 1 && s[1] == '=') {
+					type = CIRCUMFLEXEQUAL;
+					return 2;
+				}
+				type = CIRCUMFLEX;
+				return 1;
+			case '{':
+				type = LBRACE;
+				return 1;
+			case '|':
+				if (s.size() > 1 && s[1] == '=') {
+					type = VBAREQUAL;
+					return 2;
+				}
+				type = VBAR;
+				return 1;
+			case '}':
+				type = RBRACE;
+				return 1;
+			case '~':
+				type = TILDE;
+				return 1;
+			}
+			return 0;
+		}
+
+		// Returns the index in keyword.kwlist of s if it is a keyword, or npos.
+		// Generated in the same way as match_operator from
+		//
+		// groups = {}
+		// for i, k in enumerate(keyword.kwlist):
+		//     groups.setdefault(len(k), {}).setdefault(k[0], []).append((i, k))
+		//
+		// as a switch on the length and then the first byte.
+		size_t match_keyword(std::string_view s)
+		{
+			switch (s.size()) {
+			case 2:
+				switch (s[0]) {
+				case 'a':
+					if (s[1] == 's')
+						return 4;
+					break;
+				case 'i':
+					if (s[1] == 'f')
+						return 20;
+					if (s[1] == 'n')
+						return 22;
+					if (s[1] == 's')
+						return 23;
+					break;
+				case 'o':
+					if (s[1] == 'r')
+						return 27;
+					break;
+				}
+				break;
+			case 3:
+				switch (s[0]) {
+				case 'a':
+					if (s[1] == 'n' && s[2] == 'd')
+						return 3;
+					break;
+				case 'd':
+					if (s[1] == 'e' && s[2] == 'f')
+						return 11;
+					if (s[1] == 'e' && s[2] == 'l')
+						return 12;
+					break;
+				case 'f':
+					if (s[1] == 'o' && s[2] == 'r')
+						return 17;
+					break;
+				case 'n':
+					if (s[1] == 'o' && s[2] == 't')
+						return 26;
+					break;
+				case 't':
+					if (s[1] == 'r' && s[2] == 'y')
+						return 31;
+					break;
+				}
+				break;
+			case 4:
+				switch (s[0]) {
+				case 'N':
+					if (s[1] == 'o' && s[2] == 'n' && s[3] == 'e')
+						return 1;
+					break;
+				case 'T':
+					if (s[1] == 'r' && s[2] == 'u' && s[3] == 'e')
+						return 2;
+					break;
+				case 'e':
+					if (s[1] == 'l' && s[2] == 'i' && s[3] == 'f')
+						return 13;
+					if (s[1] == 'l' && s[2] == 's' && s[3] == 'e')
+						return 14;
+					break;
+				case 'f':
+					if (s[1] == 'r' && s[2] == 'o' && s[3] == 'm')
+						return 18;
+					break;
+				case 'p':
+					if (s[1] == 'a' && s[2] == 's' && s[3] == 's')
+						return 28;
+					break;
+				case 'w':
+					if (s[1] == 'i' && s[2] == 't' && s[3] == 'h')
+						return 33;
+					break;
+				}
+				break;
+			case 5:
+				switch (s[0]) {
+				case 'F':
+					if (s[1] == 'a' && s[2] == 'l' && s[3] == 's' && s[4] == 'e')
+						return 0;
+					break;
+				case 'a':
+					if (s[1] == 's' && s[2] == 'y' && s[3] == 'n' && s[4] == 'c')
+						return 6;
+					if (s[1] == 'w' && s[2] == 'a' && s[3] == 'i' && s[4] == 't')
+						return 7;
+					break;
+				case 'b':
+					if (s[1] == 'r' && s[2] == 'e' && s[3] == 'a' && s[4] == 'k')
+						return 8;
+					break;
+				case 'c':
+					if (s[1] == 'l' && s[2] == 'a' && s[3] == 's' && s[4] == 's')
+						return 9;
+					break;
+				case 'r':
+					if (s[1] == 'a' && s[2] == 'i' && s[3] == 's' && s[4] == 'e')
+						return 29;
+					break;
+				case 'w':
+					if (s[1] == 'h' && s[2] == 'i' && s[3] == 'l' && s[4] == 'e')
+						return 32;
+					break;
+				case 'y':
+					if (s[1] == 'i' && s[2] == 'e' && s[3] == 'l' && s[4] == 'd')
+						return 34;
+					break;
+				}
+				break;
+			case 6:
+				switch (s[0]) {
+				case 'a':
+					if (s[1] == 's' && s[2] == 's' && s[3] == 'e' && s[4] == 'r' && s[5] == 't')
+						return 5;
+					break;
+				case 'e':
+					if (s[1] == 'x' && s[2] == 'c' && s[3] == 'e' && s[4] == 'p' && s[5] == 't')
+						return 15;
+					break;
+				case 'g':
+					if (s[1] == 'l' && s[2] == 'o' && s[3] == 'b' && s[4] == 'a' && s[5] == 'l')
+						return 19;
+					break;
+				case 'i':
+					if (s[1] == 'm' && s[2] == 'p' && s[3] == 'o' && s[4] == 'r' && s[5] == 't')
+						return 21;
+					break;
+				case 'l':
+					if (s[1] == 'a' && s[2] == 'm' && s[3] == 'b' && s[4] == 'd' && s[5] == 'a')
+						return 24;
+					break;
+				case 'r':
+					if (s[1] == 'e' && s[2] == 't' && s[3] == 'u' && s[4] == 'r' && s[5] == 'n')
+						return 30;
+					break;
+				}
+				break;
+			case 7:
+				switch (s[0]) {
+				case 'f':
+					if (s[1] == 'i' && s[2] == 'n' && s[3] == 'a' && s[4] == 'l' && s[5] == 'l' && s[6] == 'y')
+						return 16;
+					break;
+				}
+				break;
+			case 8:
+				switch (s[0]) {
+				case 'c':
+					if (s[1] == 'o' && s[2] == 'n' && s[3] == 't' && s[4] == 'i' && s[5] == 'n' && s[6] == 'u' && s[7] == 'e')
+						return 10;
+					break;
+				case 'n':
+					if (s[1] == 'o' && s[2] == 'n' && s[3] == 'l' && s[4] == 'o' && s[5] == 'c' && s[6] == 'a' && s[7] == 'l')
+						return 25;
+					break;
+				}
+				break;
+			}
+			return npos;
+		}
+
+
+		// Special
+		size_t special(std::string_view s, size_t p, Token& type)
+		{
+			size_t n = match_operator(s.substr(p), type);
+			return n ? p + n : npos;
+		}
+
+		// StringPrefix, returns the position of the opening quote
+		size_t string_prefix(std::string_view s, size_t p)
+		{
+			size_t q = p;
+			bool b = false, r = false, u = false, f = false;
+			while (q < s.size() && q - p < 3) {
+				char c = s[q];
+				if (c == '\'' || c == '"')
+					break;
+				switch (c) {
+				case 'b': case 'B': if (b) return npos; b = true; break;
+				case 'r': case 'R': if (r) return npos; r = true; break;
+				case 'u': case 'U': if (u) return npos; u = true; break;
+				case 'f': case 'F': if (f) return npos; f = true; break;
+				default: return npos;
+				}
+				++q;
+			}
+			if (q >= s.size() || q - p > 2 || (s[q] != '\'' && s[q] != '"'))
+				return npos;
+			if ((u && q - p > 1) || (b && f))
+				return npos;
+			return q;
+		}
+
+		// StringPrefix + "'''" | StringPrefix + '"""'
+		size_t triple(std::string_view s, size_t p)
+		{
+			size_t q = string_prefix(s, p);
+			if (q == npos || q + 2 >= s.size() || s[q + 1] != s[q] || s[q + 2] != s[q])
+				return npos;
+			return q + 3;
+		}
+
+		// StringPrefix + r"'[^\n'\\]*(?:\\.[^\n'\\]*)*('|\\\r?\n)", and
+		// the same for double quotes
+		size_t contstr(std::string_view s, size_t p)
+		{
+			size_t q = string_prefix(s, p);
+			if (q == npos)
+				return npos;
+			char quote = s[q++];
+			while ((q = skip_string_body(s, q, quote)) < s.size()) {
+				char c = s[q];
+				if (c == quote)
+					return q + 1;
+				if (c == '\n')
+					return npos;
+				if (q + 1 < s.size() && s[q + 1] == '\n')
+					return q + 2;
+				if (q + 2 < s.size() && s[q + 1] == '\r' && s[q + 2] == '\n')
+					return q + 3;
+				if (q + 1 >= s.size())
+					return npos;
+				q += 2;
+			}
+			return npos;
+		}
+
+		// The rest of a string after its opening quote, which is one of
+		// Single, Double, Single3 or Double3 depending on the quote. Returns
+		// the end of the closing quote, or npos if it isn't in s.
+		size_t string_end(std::string_view s, size_t p, char quote, bool triple)
+		{
+			while ((p = skip_string_body(s, p, quote)) < s.size()) {
+				char c = s[p];
+				if (c == '\\') {
+					// As in the regex, the escaped character can't be a newline
+					if (p + 1 >= s.size() || s[p + 1] == '\n')
+						return npos;
+					p += 2;
+				}
+				else if (c == quote) {
+					if (!triple)
+						return p + 1;
+					if (p + 2 < s.size() && s[p + 1] == quote && s[p + 2] == quote)
+						return p + 3;
+					++p;
+				}
+				else
+					++p;
+			}
+			return npos;
+		}
+
+		// Name, as \w+ where \w is any character which can continue an
+		// identifier
+		size_t name(std::string_view s, size_t p)
+		{
+			size_t q = p;
+			while ((q = skip_ascii_word(s, q)) < s.size() && (s[q] & 0x80)) {
+				uint32_t cp;
+				size_t n = decode_utf8(s, q, cp);
+				if (!n || !is_xid_continue(cp))
+					break;
+				q += n;
+			}
+			return q > p ? q : npos;
+		}
+
+		// initial.isidentifier()
+		bool name_start(std::string_view s, size_t p)
+		{
+			uint32_t cp;
+			return decode_utf8(s, p, cp) && is_xid_start(cp);
+		}
+
+		// Matches PseudoToken against s at p. On success returns true and
+		// sets [start, end) to the span of the token, which is empty when
+		// only whitespace remains. The type of an operator is set in op,
+		// which is otherwise left as OP.
+		bool pseudo_token(std::string_view s, size_t p, size_t& start, size_t& end, Token& op)
+		{
+			op = OP;
+			while (p < s.size() && (s[p] == ' ' || s[p] == '\f' || s[p] == '\t'))
+				++p;
+			start = p;
+			if (p == s.size()) {
+				end = p;
+				return true;
+			}
+
+			char c = s[p];
+			size_t q = npos;
+			if (c == '\\') {
+				if (p + 1 < s.size() && s[p + 1] == '\n')
+					q = p + 2;
+				else if (p + 2 < s.size() && s[p + 1] == '\r' && s[p + 2] == '\n')
+					q = p + 3;
+			}
+			else if (c == '#') {
+				q = s.find_first_of("\r\n", p);
+				if (q == npos)
+					q = s.size();
+			}
+			else if (c == '\n') {
+				q = p + 1;
+			}
+			else if (c == '\r') {
+				if (p + 1 < s.size() && s[p + 1] == '\n')
+					q = p + 2;
+			}
+			else if (is_digit(c) || c == '.') {
+				q = number(s, p);
+				if (q == npos)
+					q = special(s, p, op);
+			}
+			else if (is_word(c) || c == '\'' || c == '"') {
+				q = triple(s, p);
+				if (q == npos)
+					q = contstr(s, p);
+				if (q == npos && is_word(c))
+					q = name(s, p);
+			}
+			else if (c & 0x80) {
+				q = name(s, p);
+			}
+			else {
+				q = special(s, p, op);
+			}
+
+			if (q == npos)
+				return false;
+			end = q;
+			return true;
+		}
+	}
+
+	Token exact_type(Token type, std::string_view token)
+	{
+		Token exact;
+		if (type == OP && !token.empty() && scanner::match_operator(token, exact) == token.size())
+			return exact;
+		return type;
+	}
+
+	TokenView::TokenView(Token type,
+		std::string_view token,
+		std::pair<size_t, size_t> start,
+		std::pair<size_t, size_t> end,
+		std::string_view line)
+		: type(type)
+		, exact(tokenize_py::exact_type(type, token))
+		, token(token)
+		, start(start)
+		, end(end)
+		, line(line)
+	{
+
+	}
+
+	TokenView::TokenView(Token type,
+		std::string_view token,
+		std::pair<size_t, size_t> start,
+		std::pair<size_t, size_t> end,
+		std::string_view line,
+		Token exact)
+		: type(type)
+		, exact(exact)
+		, token(token)
+		, start(start)
+		, end(end)
+		, line(line)
+	{
+
+	}
+
+	Token TokenView::exact_type() const
+	{
+		return exact;
+	}
+
+	// A token with only a type and a string, as built by hand to be
+	// untokenized, has no position
+	bool TokenView::is_empty() const
+	{
+		return start == std::pair<size_t, size_t>(0, 0) && end == start && line.empty();
+	}
+
+	std::ostream& operator << (std::ostream& stream, const TokenView& tokview)
+	{
+		return stream
+			<< "[type=" << to_string(tokview.type)
+			<< ", token=\"" << tokview.token << "\""
+			<< ", start=(" << tokview.start.first << ", " << tokview.start.second << ")"
+			<< ", end=(" << tokview.end.first << ", " << tokview.end.second << ")"
+			<< ", line=\"" << tokview.line << "\"]";
+	}
+
 	TokenInfo::TokenInfo(Token type,
 		const std::string& token,
 		std::pair<size_t, size_t> start,
 		std::pair<size_t, size_t> end,
 		const std::string& line)
 		: type(type)
+		, exact(tokenize_py::exact_type(type, token))
 		, token(token)
 		, start(start)
 		, end(end)
@@ -125,61 +964,268 @@ namespace tokenize_py
 
 	}
 
+	TokenInfo::TokenInfo(const TokenView& view)
+		: type(view.type)
+		, exact(view.exact)
+		, token(view.token)
+		, start(view.start)
+		, end(view.end)
+		, line(view.line)
+	{
+
+	}
+
 	Token TokenInfo::exact_type() const
 	{
-		if (type == OP && exact_token_types.find(token) != exact_token_types.end())
-			return exact_token_types.at(token);
-		return type;
+		return exact;
 	}
 
+	// A token with only a type and a string, as built by hand to be
+	// untokenized, has no position
 	bool TokenInfo::is_empty() const
 	{
-		return line.empty();
+		return start == std::pair<size_t, size_t>(0, 0) && end == start && line.empty();
 	}
 
 	std::ostream& operator << (std::ostream& stream, const TokenInfo& tokinfo)
 	{
-		return stream
-			<< "[type=" << to_string(tokinfo.type)
-			<< ", token=\"" << tokinfo.token << "\""
-			<< ", start=(" << tokinfo.start.first << ", " << tokinfo.start.second << ")"
-			<< ", end=(" << tokinfo.end.first << ", " << tokinfo.end.second << ")"
-			<< ", line=\"" << tokinfo.line << "\"]";
+		return stream << TokenView(tokinfo.type, tokinfo.token, tokinfo.start, tokinfo.end, tokinfo.line);
 	}
 
-	TokenError::TokenError(const std::string& msg, const std::pair<size_t, size_t>& pos)
-		: std::runtime_error(msg + ": (" + std::to_string(pos.first) + ", " + std::to_string(pos.second) + ")")
+	TokenStream::const_iterator TokenStream::begin() const
 	{
-
+		return tokens.begin();
 	}
 
-	class Untokenizer
+	TokenStream::const_iterator TokenStream::end() const
 	{
-	public:
-		Untokenizer();
+		return tokens.end();
+	}
 
-		void add_whitespace(const std::pair<size_t, size_t>& start);
-		std::string untokenize(const std::vector<TokenInfo>& iter);
-		void compat(const TokenInfo& token, const std::vector<TokenInfo>& iter);
+	size_t TokenStream::size() const
+	{
+		return tokens.size();
+	}
 
-	private:
-		std::vector<std::string> tokens;
-		size_t prev_row, prev_col;
-		std::string encoding;
-	};
+	const TokenView& TokenStream::operator [] (size_t i) const
+	{
+		return tokens[i];
+	}
 
-	Untokenizer::Untokenizer()
-		: prev_row(1)
-		, prev_col(0)
+	CompactTokenStream::const_iterator::const_iterator(const CompactTokenStream* tokens, size_t i)
+		: tokens(tokens)
+		, i(i)
 	{
 
 	}
 
-	void Untokenizer::add_whitespace(const std::pair<size_t, size_t>& start)
+	TokenView CompactTokenStream::const_iterator::operator * () const
 	{
-		using namespace helpers;
+		return (*tokens)[i];
+	}
 
-		size_t row = start.first;
+	TokenView CompactTokenStream::const_iterator::operator [] (difference_type n) const
+	{
+		return (*tokens)[i + n];
+	}
+
+	CompactTokenStream::const_iterator& CompactTokenStream::const_iterator::operator ++ ()
+	{
+		++i;
+		return *this;
+	}
+
+	CompactTokenStream::const_iterator CompactTokenStream::const_iterator::operator ++ (int)
+	{
+		auto copy = *this;
+		++i;
+		return copy;
+	}
+
+	CompactTokenStream::const_iterator& CompactTokenStream::const_iterator::operator += (difference_type n)
+	{
+		i += n;
+		return *this;
+	}
+
+	CompactTokenStream::const_iterator CompactTokenStream::const_iterator::operator + (difference_type n) const
+	{
+		return const_iterator(tokens, i + n);
+	}
+
+	CompactTokenStream::const_iterator::difference_type CompactTokenStream::const_iterator::operator - (const const_iterator& other) const
+	{
+		return static_cast<difference_type>(i) - static_cast<difference_type>(other.i);
+	}
+
+	bool CompactTokenStream::const_iterator::operator == (const const_iterator& other) const
+	{
+		return i == other.i;
+	}
+
+	bool CompactTokenStream::const_iterator::operator != (const const_iterator& other) const
+	{
+		return i != other.i;
+	}
+
+	bool CompactTokenStream::const_iterator::operator < (const const_iterator& other) const
+	{
+		return i < other.i;
+	}
+
+	CompactTokenStream::CompactTokenStream()
+	{
+
+	}
+
+	CompactTokenStream::CompactTokenStream(const TokenStream& tokens)
+		: storage(tokens.storage)
+		, source(tokens.source)
+	{
+		reserve(tokens.size());
+		for (const auto& token : tokens)
+			push_back(token);
+	}
+
+	void CompactTokenStream::push_back(const TokenView& token)
+	{
+		if (source.size() > UINT32_MAX)
+			throw std::length_error("source is too large for a CompactTokenStream");
+
+		// Returns the offset of a view into the source, or zero if it is
+		// empty or refers elsewhere
+		auto offset = [&](std::string_view view) {
+			if (view.empty() || view.data() < source.data() || view.data() > source.data() + source.size())
+				return uint32_t(0);
+			return static_cast<uint32_t>(view.data() - source.data());
+		};
+
+		if (token.type == ENCODING)
+			encoding = token.token;
+		types.push_back(static_cast<uint8_t>(token.type));
+		offsets.push_back(offset(token.token));
+		lengths.push_back(static_cast<uint32_t>(token.token.size()));
+
+		std::pair<uint32_t, uint32_t> span(offset(token.line), static_cast<uint32_t>(token.line.size()));
+		if (line_spans.empty() || line_spans.back() != span)
+			line_spans.push_back(span);
+		lines.push_back(static_cast<uint32_t>(line_spans.size() - 1));
+
+		starts.push_back({ static_cast<uint32_t>(token.start.first), static_cast<uint32_t>(token.start.second) });
+		ends.push_back({ static_cast<uint32_t>(token.end.first), static_cast<uint32_t>(token.end.second) });
+	}
+
+	void CompactTokenStream::reserve(size_t n)
+	{
+		types.reserve(n);
+		offsets.reserve(n);
+		lengths.reserve(n);
+		lines.reserve(n);
+		starts.reserve(n);
+		ends.reserve(n);
+	}
+
+	CompactTokenStream::const_iterator CompactTokenStream::begin() const
+	{
+		return const_iterator(this, 0);
+	}
+
+	CompactTokenStream::const_iterator CompactTokenStream::end() const
+	{
+		return const_iterator(this, size());
+	}
+
+	size_t CompactTokenStream::size() const
+	{
+		return types.size();
+	}
+
+	TokenView CompactTokenStream::operator [] (size_t i) const
+	{
+		auto type = static_cast<Token>(types[i]);
+		auto token = type == ENCODING ? std::string_view(encoding) : source.substr(offsets[i], lengths[i]);
+		const auto& span = line_spans[lines[i]];
+		return TokenView(type,
+			token,
+			std::make_pair<size_t, size_t>(starts[i].line, starts[i].col),
+			std::make_pair<size_t, size_t>(ends[i].line, ends[i].col),
+			source.substr(span.first, span.second));
+	}
+
+	TokenError::TokenError(const std::string& msg, const std::pair<size_t, size_t>& pos)
+		: std::runtime_error(msg + ": (" + std::to_string(pos.first) + ", " + std::to_string(pos.second) + ")")
+	{
+
+	}
+
+	LimitError::LimitError(Limit limit, const std::string& msg, const std::pair<size_t, size_t>& pos)
+		: TokenError(msg, pos)
+		, limit(limit)
+	{
+
+	}
+
+	// Where untokenized source is written, either a string which has been
+	// sized in advance or a stream
+	class SourceWriter
+	{
+	public:
+		explicit SourceWriter(std::string& buffer) : buffer(&buffer), stream(nullptr) {}
+		explicit SourceWriter(std::ostream& stream) : buffer(nullptr), stream(&stream) {}
+
+		void write(std::string_view s)
+		{
+			if (buffer)
+				buffer->append(s.data(), s.size());
+			else
+				stream->write(s.data(), s.size());
+		}
+
+		void write(std::string_view s, size_t n)
+		{
+			while (n--)
+				write(s);
+		}
+
+		void fill(char c, size_t n)
+		{
+			if (buffer)
+				buffer->append(n, c);
+			else
+				std::fill_n(std::ostreambuf_iterator<char>(*stream), n, c);
+		}
+
+	private:
+		std::string* buffer;
+		std::ostream* stream;
+	};
+
+	class Untokenizer
+	{
+	public:
+		explicit Untokenizer(SourceWriter out);
+
+		void add_whitespace(const std::pair<size_t, size_t>& start);
+		void untokenize(const std::vector<TokenInfo>& iter);
+		void compat(std::vector<TokenInfo>::const_iterator first, std::vector<TokenInfo>::const_iterator last);
+
+	private:
+		SourceWriter out;
+		size_t prev_row, prev_col;
+		std::string encoding;
+	};
+
+	Untokenizer::Untokenizer(SourceWriter out)
+		: out(out)
+		, prev_row(1)
+		, prev_col(0)
+	{
+
+	}
+
+	void Untokenizer::add_whitespace(const std::pair<size_t, size_t>& start)
+	{
+		size_t row = start.first;
 		size_t col = start.second;
 
 		if (row < prev_row || row == prev_row && col < prev_col) {
@@ -191,27 +1237,28 @@ namespace tokenize_py
 
 		size_t row_offset = row - prev_row;
 		if (row_offset) {
-			tokens.push_back(repeat("\\\n", row_offset));
+			out.write("\\\n", row_offset);
 			prev_col = 0;
 		}
 		size_t col_offset = col - prev_col;
 		if (col_offset)
-			tokens.push_back(repeat(" ", col_offset));
+			out.fill(' ', col_offset);
 	}
 
-	std::string Untokenizer::untokenize(const std::vector<TokenInfo>& iter)
+	void Untokenizer::untokenize(const std::vector<TokenInfo>& iter)
 	{
-		std::vector<std::string> indents;
+		std::vector<std::string_view> indents;
 		bool startline = false;
-		for (const auto& t : iter) {
-			if (t.is_empty()) {
-				compat(t, iter);
-				break;
-			}
+		for (auto it = iter.begin(); it != iter.end(); ++it) {
+			const auto& t = *it;
 			if (t.type == ENCODING) {
 				encoding = t.token;
 				continue;
 			}
+			if (t.is_empty()) {
+				compat(it, iter.end());
+				break;
+			}
 			if (t.type == ENDMARKER) {
 				break;
 			}
@@ -231,13 +1278,13 @@ namespace tokenize_py
 			else if (startline && !indents.empty()) {
 				auto indent = indents.back();
 				if (t.start.second >= indent.size()) {
-					tokens.push_back(indent);
+					out.write(indent);
 					prev_col = indent.size();
 				}
 				startline = false;
 			}
 			add_whitespace(t.start);
-			tokens.push_back(t.token);
+			out.write(t.token);
 			prev_row = t.end.first;
 			prev_col = t.end.second;
 			if (t.type == NEWLINE || t.type == NL) {
@@ -245,33 +1292,26 @@ namespace tokenize_py
 				prev_col = 0;
 			}
 		}
-		return helpers::join("", tokens);
 	}
 
-	void Untokenizer::compat(const TokenInfo& token, const std::vector<TokenInfo>& iter)
+	void Untokenizer::compat(std::vector<TokenInfo>::const_iterator first, std::vector<TokenInfo>::const_iterator last)
 	{
-		std::vector<std::string> indents;
-		bool startline = (token.type == NEWLINE || token.type == NL);
+		std::vector<std::string_view> indents;
+		bool startline = (first->type == NEWLINE || first->type == NL);
 		bool prevstring = false;
 
-		std::vector<TokenInfo> chain;
-		chain.push_back(token);
-		chain.insert(chain.end(), iter.begin(), iter.end());
-
-		for (const auto& tok : chain) {
-			auto toknum = tok.type;
-			auto tokval = tok.token;
+		for (; first != last; ++first) {
+			auto toknum = first->type;
+			std::string_view tokval = first->token;
 			if (toknum == ENCODING) {
 				encoding = tokval;
 				continue;
 			}
-			if (toknum == NAME || toknum == NUMBER) {
-				tokval += " ";
-			}
 
+			// Insert a space between two consecutive strings
+			bool space_before = false;
 			if (toknum == STRING) {
-				if (prevstring)
-					tokval = ' ' + tokval;
+				space_before = prevstring;
 				prevstring = true;
 			}
 			else
@@ -289,254 +1329,2192 @@ namespace tokenize_py
 				startline = true;
 			}
 			else if (startline && !indents.empty()) {
-				tokens.push_back(indents.back());
+				out.write(indents.back());
 				startline = false;
 			}
-			tokens.push_back(tokval);
+			if (space_before)
+				out.fill(' ', 1);
+			out.write(tokval);
+			if (toknum == NAME || toknum == NUMBER)
+				out.fill(' ', 1);
 		}
 	}
 
-	std::string untokenize(const std::vector<TokenInfo>& iterable)
+	// An estimate of the length of the source a token list came from, taken
+	// from the extents of its tokens so that the output is allocated once
+	size_t untokenized_size(const std::vector<TokenInfo>& iterable)
 	{
-		Untokenizer ut;
-		auto out = ut.untokenize(iterable);
-		return out;
+		size_t size = 0;
+		size_t row = 1, col = 0;
+		for (const auto& t : iterable) {
+			size += t.token.size();
+			if (t.start.first == row && t.start.second > col)
+				size += t.start.second - col;
+			else if (t.start.first > row)
+				size += 2 * (t.start.first - row) + t.start.second;
+			row = t.end.first;
+			col = t.end.second;
+			if (t.type == NEWLINE || t.type == NL) {
+				++row;
+				col = 0;
+			}
+		}
+		return size;
 	}
 
-	std::string get_normal_name(const std::string orig_enc)
+	std::string untokenize(const std::vector<TokenInfo>& iterable)
 	{
-		return "utf-8";
+		std::string out;
+		out.reserve(untokenized_size(iterable));
+		Untokenizer(SourceWriter(out)).untokenize(iterable);
+		return out;
 	}
 
-	std::pair<std::string, std::vector<std::string>> detect_encoding(std::istream& stream)
+	void untokenize(const std::vector<TokenInfo>& iterable, std::ostream& out)
 	{
-		return { "utf-8", {} };
+		Untokenizer(SourceWriter(out)).untokenize(iterable);
 	}
 
-	std::vector<TokenInfo> tokenize(std::istream& stream)
+	namespace codecs
 	{
-		std::vector<TokenInfo> tokens;
-		size_t lnum = 0;
-		size_t parenlev = 0;
-		size_t continued = 0;
-		std::string numchars = "0123456789";
-		std::string contstr = "";
-		size_t needcont = 0;
-		std::optional<std::string> contline;
-		std::vector<size_t> indents = { 0 };
-		std::string endprog;
-		std::pair<size_t, size_t> strstart;
-
-		tokens.emplace_back(ENCODING, "utf-8", std::pair<size_t, size_t>(0, 0), std::pair<size_t, size_t>(0, 0), "");
-
-		std::string last_line = "";
-		std::string line = "";
-
-		while (std::getline(stream, line)) {
-			lnum += 1;
-			size_t pos = 0;
-			size_t max = line.size();
-
-			if (!contstr.empty()) {
-				if (line.empty())
-					throw TokenError("EOF in multi-line string", strstart);
-				std::smatch endmatch;
-				if (std::regex_match(line, endmatch, std::regex(endprog))) {
-					size_t end = pos = endmatch.position() + endmatch.length();
-					tokens.emplace_back(STRING,
-						contstr + line.substr(0, end),
-						strstart,
-						std::pair<size_t, size_t>(lnum, end),
-						*contline + line);
-					contstr = "";
-					needcont = 0;
-					contline.reset();
-				}
-				else if (needcont &&
-					!helpers::ends_with(line, "\\\n") &&
-					!helpers::ends_with(line, "\\\r\n")) {
-					tokens.emplace_back(ERRORTOKEN,
-						contstr + line,
-						strstart,
-						std::pair<size_t, size_t>(lnum, line.size()),
-						*contline);
-					contstr = "";
-					contline.reset();
-					continue;
-				}
-				else {
-					contstr += line;
-					*contline += line;
-					continue;
+		enum Kind { UTF_8, LATIN_1, CP1252, UTF_16_LE, UTF_16_BE };
+
+		struct Codec
+		{
+			std::string_view name;
+			Kind kind;
+			std::string_view bom;
+		};
+
+		// The encodings which can be decoded, under the names python gives
+		// them, followed by their other names
+		const Codec codecs[] = {
+			{ "utf-8", UTF_8, "" },
+			{ "utf-8-sig", UTF_8, "\xef\xbb\xbf" },
+			{ "iso-8859-1", LATIN_1, "" },
+			{ "cp1252", CP1252, "" },
+			{ "utf-16-le", UTF_16_LE, "\xff\xfe" },
+			{ "utf-16-be", UTF_16_BE, "\xfe\xff" },
+		};
+		const std::pair<std::string_view, std::string_view> aliases[] = {
+			{ "utf8", "utf-8" }, { "ascii", "utf-8" }, { "us-ascii", "utf-8" },
+			{ "latin1", "iso-8859-1" }, { "latin", "iso-8859-1" }, { "l1", "iso-8859-1" },
+			{ "iso8859-1", "iso-8859-1" }, { "cp819", "iso-8859-1" },
+			{ "windows-1252", "cp1252" }, { "utf-16le", "utf-16-le" }, { "utf-16be", "utf-16-be" },
+		};
+
+		// The code points of cp1252 bytes 0x80 to 0x9f, where those left
+		// undefined are zero
+		const uint16_t cp1252_high[32] = {
+			0x20ac, 0, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+			0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017d, 0,
+			0, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+			0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0, 0x017e, 0x0178,
+		};
+
+		const Codec& lookup(const std::string& encoding)
+		{
+			auto name = helpers::replace(helpers::to_lower(encoding), "_", "-");
+			for (const auto& alias : aliases) {
+				if (name == alias.first)
+					name = alias.second;
+			}
+			for (const auto& codec : codecs) {
+				if (name == codec.name)
+					return codec;
+			}
+			throw std::runtime_error("unknown encoding: " + encoding);
+		}
+
+		template <typename String>
+		void append_utf8(String& out, uint32_t cp)
+		{
+			if (cp < 0x80) {
+				out += char(cp);
+			}
+			else if (cp < 0x800) {
+				out += char(0xc0 | cp >> 6);
+				out += char(0x80 | cp & 0x3f);
+			}
+			else if (cp < 0x10000) {
+				out += char(0xe0 | cp >> 12);
+				out += char(0x80 | cp >> 6 & 0x3f);
+				out += char(0x80 | cp & 0x3f);
+			}
+			else {
+				out += char(0xf0 | cp >> 18);
+				out += char(0x80 | cp >> 12 & 0x3f);
+				out += char(0x80 | cp >> 6 & 0x3f);
+				out += char(0x80 | cp & 0x3f);
+			}
+		}
+
+		[[noreturn]] void decode_error(const Codec& codec, size_t pos, const std::string& reason)
+		{
+			throw std::runtime_error("'" + std::string(codec.name) + "' codec can't decode byte in position " +
+				std::to_string(pos) + ": " + reason);
+		}
+
+		// Appends source decoded from the codec to out as UTF-8, less the
+		// codec's BOM if it starts with one
+		template <typename String>
+		void decode(std::string_view source, const Codec& codec, String& out)
+		{
+			size_t i = helpers::starts_with(source, codec.bom) ? codec.bom.size() : 0;
+			if (codec.kind == UTF_8) {
+				out.append(source.data() + i, source.size() - i);
+				return;
+			}
+			if (codec.kind == UTF_16_LE || codec.kind == UTF_16_BE) {
+				out.reserve(out.size() + (source.size() - i) / 2 * 3);
+				auto unit = [&](size_t k) -> uint32_t {
+					unsigned char a = source[k], b = source[k + 1];
+					return codec.kind == UTF_16_LE ? a | b << 8 : a << 8 | b;
+				};
+				for (; i + 1 < source.size(); i += 2) {
+					uint32_t cp = unit(i);
+					if (cp >= 0xd800 && cp <= 0xdbff) {
+						uint32_t low = i + 3 < source.size() ? unit(i + 2) : 0;
+						if (low < 0xdc00 || low > 0xdfff)
+							decode_error(codec, i, "unpaired surrogate");
+						cp = 0x10000 + ((cp - 0xd800) << 10 | (low - 0xdc00));
+						i += 2;
+					}
+					else if (cp >= 0xdc00 && cp <= 0xdfff)
+						decode_error(codec, i, "unpaired surrogate");
+					append_utf8(out, cp);
 				}
+				if (i < source.size())
+					decode_error(codec, i, "truncated data");
+				return;
 			}
-			else if (parenlev == 0 && !continued) {
-				if (line.empty())
+
+			// Single byte encodings are ASCII below 0x80, which is copied in
+			// runs
+			out.reserve(out.size() + source.size() + source.size() / 8);
+			while (i < source.size()) {
+				size_t run = i;
+				while (run < source.size() && !(source[run] & 0x80))
+					++run;
+				out.append(source.data() + i, run - i);
+				if (run == source.size())
 					break;
-				size_t column = 0;
-				while (pos < max) {
-					if (line[pos] == ' ')
-						++column;
-					else if (line[pos] == '\t')
-						column = (column / tabsize + 1) * tabsize;
-					else if (line[pos] == '\f')
-						column = 0;
-					else
-						break;
-					++pos;
+				unsigned char c = source[run];
+				uint32_t cp = c;
+				if (codec.kind == CP1252 && c < 0xa0) {
+					cp = cp1252_high[c - 0x80];
+					if (!cp)
+						decode_error(codec, run, "character maps to <undefined>");
 				}
-				if (pos == max)
-					break;
+				append_utf8(out, cp);
+				i = run + 1;
+			}
+		}
 
-				if (line[pos] == '#' || line[pos] == '\r' || line[pos] == '\n') {
-					if (line[pos] == '#') {
-						auto comment_token = helpers::rstrip(line.substr(pos), "\r\n");
-						tokens.emplace_back(COMMENT,
-							comment_token,
-							std::make_pair(lnum, pos),
-							std::make_pair(lnum, pos + comment_token.size()),
-							line);
-						pos += comment_token.size();
-					}
-					tokens.emplace_back(NL,
-						line.substr(pos),
-						std::make_pair(lnum, pos),
-						std::make_pair(lnum, line.size()),
-						line);
+		// The encoding given by the ENCODING token, which is plain utf-8 once
+		// the BOM has been skipped
+		std::string_view token_name(std::string_view encoding)
+		{
+			return encoding == codecs[1].name ? codecs[0].name : encoding;
+		}
+
+		// Matches ^[ \t\f]*#.*?coding[:=][ \t]*([-\w.]+)
+		bool find_cookie(std::string_view line, std::string& encoding)
+		{
+			size_t i = line.find_first_not_of(" \t\f");
+			if (i == std::string_view::npos || line[i] != '#')
+				return false;
+			auto name_char = [](char c) {
+				return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' || c == '.';
+			};
+			auto end = line.find_first_of("\r\n", i);
+			line = line.substr(0, end);
+			for (i = line.find("coding", i); i != std::string_view::npos; i = line.find("coding", i + 1)) {
+				size_t k = i + 6;
+				if (k >= line.size() || (line[k] != ':' && line[k] != '='))
 					continue;
+				k = line.find_first_not_of(" \t", k + 1);
+				size_t e = k;
+				while (e < line.size() && name_char(line[e]))
+					++e;
+				if (k != std::string_view::npos && e > k) {
+					encoding = line.substr(k, e - k);
+					return true;
 				}
-				if (column > indents.back()) {
-					indents.push_back(column);
-					tokens.emplace_back(INDENT,
-						line.substr(0, pos),
-						std::make_pair(lnum, 0),
-						std::make_pair(lnum, pos),
-						line);
-				}
-				while (column < indents.back()) {
-					if (std::find(indents.begin(), indents.end(), column) == indents.end()) 
-						throw std::runtime_error("unindent does not match any outer indentation level");
-						indents.pop_back();
-					tokens.emplace_back(DEDENT,
-						"",
-						std::make_pair(lnum, pos),
-						std::make_pair(lnum, pos),
-						line);
-				}
-			}
-			else {
-				if (line.empty())
-					throw TokenError("EOF in multi-line statement", std::pair<size_t, size_t>(lnum, 0));
-				continued = 0;
 			}
+			return false;
+		}
 
-			while (pos < max) {
-				std::match_results<std::string::iterator> pseudomatch;
-				if (std::regex_match(line.begin() + pos, line.end(), pseudomatch, std::regex(PseudoToken))) {
-					size_t start = std::distance(line.begin(), pseudomatch[1].first);
-					size_t end = std::distance(line.begin(), pseudomatch[1].second);;
-					if (start == end)
-						continue;
-					auto spos = std::make_pair(lnum, start);
-					auto epos = std::make_pair(lnum, end);
-					auto pos = end;
-					auto token = line.substr(start, end - start);
-					auto initial = line[start];
-					if (numchars.find(initial) != std::string::npos ||
-						(initial == '.' && token != "." && token != "...")) {
-						tokens.emplace_back(NUMBER, token, spos, epos, line);
-					}
-					else if (initial == '\r' || initial == '\n') {
-						if (parenlev > 0)
-							tokens.emplace_back(NL, token, spos, epos, line);
-						else
-							tokens.emplace_back(NEWLINE, token, spos, epos, line);
-					}
-					else if (initial == '#') {
-						assert(!helpers::ends_with(token, "\n"));
-						tokens.emplace_back(COMMENT, token, spos, epos, line);
-					}
-					else if (triple_quoted.find(token) != triple_quoted.end()) {
-						endprog = endpats.at(token);
-						std::match_results<std::string::iterator> endmatch;
-						if (std::regex_match(line.begin() + pos, line.end(), endmatch, std::regex(endprog))) {
-							pos = endmatch.position() + endmatch.length();
-							token = line.substr(start, pos - start);
-							tokens.emplace_back(STRING, token, spos, std::make_pair(lnum, pos), line);
-						}
-						else {
-							strstart = std::make_pair(lnum, start);
-							contstr = line.substr(start);
-							contline = line;
-							break;
-						}
-					}
-					else if (single_quoted.find(token) != single_quoted.cend() ||
-							single_quoted.find(token.substr(0, 2)) != single_quoted.cend() ||
-							single_quoted.find(token.substr(0, 3)) != single_quoted.cend()) {
-						if (token.back() == '\n') {
-							strstart = std::make_pair(lnum, start);
-							if (endpats.find(std::string(1, initial)) != endpats.end())
-								endprog = endpats.at(std::string(1, initial));
-							else if (endpats.find(token.substr(1, 2)) != endpats.end())
-								endprog = endpats.at(token.substr(1, 2));
-							else
-								endprog = endpats.at(token.substr(2, 3));
-							contstr = line.substr(start);
-							needcont = 1;
-							break;
-						}
-						else {
-							tokens.emplace_back(STRING, token, spos, epos, line);
-						}
-					}
-					else if (std::regex_match(std::string(1, initial), std::regex(Identifier))) {
-						tokens.emplace_back(NAME, token, spos, epos, line);
-					}
-					else if (initial == '\\') {
-						continued = 1;
-					}
-					else {
-						if (initial == '(' || initial == '[' || initial == '{') {
-							++parenlev;
-						}
-						else if (initial == ')' || initial == ']' || initial == '}') {
-							--parenlev;
-						}
-						tokens.emplace_back(OP, token, spos, epos, line);
+		// Matches ^[ \t\f]*(?:[#\r\n]|$)
+		bool is_blank(std::string_view line)
+		{
+			size_t i = line.find_first_not_of(" \t\f");
+			return i == std::string_view::npos || line[i] == '#' || line[i] == '\r' || line[i] == '\n';
+		}
+
+		// Works out the encoding of a source from its first two lines in the
+		// same way as python. Each line is only read if it is needed, and the
+		// lines which were read are left in lines with any UTF-8 BOM removed.
+		template <typename ReadLine, typename Lines>
+		std::string detect(ReadLine read_line, Lines& lines)
+		{
+			bool bom = false;
+			std::string default_encoding = "utf-8";
+			std::string_view first;
+			if (!read_line(first))
+				return default_encoding;
+			if (helpers::starts_with(first, codecs[1].bom)) {
+				bom = true;
+				first.remove_prefix(codecs[1].bom.size());
+				default_encoding = "utf-8-sig";
+			}
+			else {
+				for (const auto& codec : codecs) {
+					if (codec.kind != UTF_8 && !codec.bom.empty() && helpers::starts_with(first, codec.bom)) {
+						lines.push_back(first);
+						return std::string(codec.name);
 					}
 				}
-				else {
-					tokens.emplace_back(ERRORTOKEN,
-						std::string(1, line[pos]),
-						std::make_pair(lnum, pos),
-						std::make_pair(lnum, pos + 1),
-						line);
-					++pos;
+			}
+			lines.push_back(first);
+
+			auto cookie = [&](std::string_view line, std::string& encoding) {
+				if (find_invalid_utf8(line) != std::string_view::npos)
+					throw std::runtime_error("invalid or missing encoding declaration");
+				if (!find_cookie(line, encoding))
+					return false;
+				encoding = get_normal_name(encoding);
+				lookup(encoding);
+				if (bom) {
+					if (encoding != "utf-8")
+						throw std::runtime_error("encoding problem: utf-8");
+					encoding += "-sig";
 				}
+				return true;
+			};
+
+			std::string encoding;
+			if (cookie(first, encoding))
+				return encoding;
+			if (!is_blank(first))
+				return default_encoding;
+			std::string_view second;
+			if (!read_line(second))
+				return default_encoding;
+			lines.push_back(second);
+			if (cookie(second, encoding))
+				return encoding;
+			return default_encoding;
+		}
+
+		// Reads the lines of a buffer for detect()
+		auto buffer_lines(std::string_view source)
+		{
+			return [source, position = size_t(0)](std::string_view& line) mutable {
+				if (position == source.size())
+					return false;
+				auto newline = source.find('\n', position);
+				size_t end = newline == std::string_view::npos ? source.size() : newline + 1;
+				line = source.substr(position, end - position);
+				position = end;
+				return true;
+			};
+		}
+
+		// Throws a TokenError at the first byte of text after position which
+		// isn't part of a UTF-8 character, where the line at position is lnum
+		void check_utf8(std::string_view text, size_t position, size_t lnum)
+		{
+			size_t bad = find_invalid_utf8(text.substr(position));
+			if (bad == std::string_view::npos)
+				return;
+			bad += position;
+			lnum += std::count(text.begin() + position, text.begin() + bad, '\n');
+			size_t line = text.rfind('\n', bad);
+			line = line == std::string_view::npos || line < position ? position : line + 1;
+			throw TokenError("invalid utf-8", std::make_pair(lnum, bad - line));
+		}
+
+		// Works out the encoding of a buffer from its BOM and first two
+		// lines. A source which isn't UTF-8 is transcoded into decoded and
+		// text is set to refer to it, otherwise text is the source itself.
+		// Returns the offset of the first line, after any BOM.
+		size_t decode_source(std::string_view source, std::string_view& encoding,
+			std::string_view& text, std::pmr::string& decoded)
+		{
+			// No more than two lines are looked at, which are kept on the stack
+			char buffer[4 * sizeof(std::string_view)];
+			std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+			std::pmr::vector<std::string_view> lines(&arena);
+			lines.reserve(2);
+			const auto& codec = lookup(detect(buffer_lines(source), lines));
+			encoding = codec.name;
+			if (codec.kind == UTF_8) {
+				text = source;
+				size_t position = helpers::starts_with(source, codec.bom) ? codec.bom.size() : 0;
+				check_utf8(source, position, 1);
+				return position;
 			}
-			last_line = line;
+			decode(source, codec, decoded);
+			text = decoded;
+			return 0;
 		}
+	}
 
-		if (!last_line.empty() && last_line.back() != '\r' && last_line.back() != '\n')
-			tokens.emplace_back(NEWLINE,
-				"",
-				std::make_pair(lnum - 1, last_line.size()),
-				std::make_pair(lnum - 1, last_line.size() + 1),
-				"");
-		for (size_t i = 1; i < indents.size(); ++i)
-			tokens.emplace_back(DEDENT,
-				"",
-				std::make_pair(lnum, 0),
-				std::make_pair(lnum, 0),
-				"");
-		tokens.emplace_back(ENDMARKER,
-			"",
-			std::make_pair(lnum, 0),
-			std::make_pair(lnum, 0),
-			"");
+	std::string get_normal_name(const std::string orig_enc)
+	{
+		// Only care about the first 12 characters
+		auto enc = helpers::replace(helpers::to_lower(orig_enc.substr(0, 12)), "_", "-");
+		if (enc == "utf-8" || helpers::starts_with(enc, "utf-8-"))
+			return "utf-8";
+		for (std::string_view latin : { "latin-1", "iso-8859-1", "iso-latin-1" }) {
+			if (enc == latin || helpers::starts_with(enc, std::string(latin) + "-"))
+				return "iso-8859-1";
+		}
+		return orig_enc;
+	}
 
-		return tokens;
+	std::pair<std::string, std::vector<std::string>> detect_encoding(std::istream& stream)
+	{
+		std::vector<std::string> read;
+		read.reserve(2);
+		std::vector<std::string_view> lines;
+		auto encoding = codecs::detect([&](std::string_view& line) {
+			std::string input;
+			if (!std::getline(stream, input))
+				return false;
+			if (!stream.eof())
+				input += '\n';
+			read.push_back(std::move(input));
+			line = read.back();
+			return true;
+		}, lines);
+		return { encoding, std::vector<std::string>(lines.begin(), lines.end()) };
+	}
+
+	std::pair<std::string, std::vector<std::string>> detect_encoding(std::string_view source)
+	{
+		std::vector<std::string_view> lines;
+		auto encoding = codecs::detect(codecs::buffer_lines(source), lines);
+		return { encoding, std::vector<std::string>(lines.begin(), lines.end()) };
+	}
+
+	std::string decode(std::string_view source, const std::string& encoding)
+	{
+		std::string out;
+		codecs::decode(source, codecs::lookup(get_normal_name(encoding)), out);
+		return out;
+	}
+
+	TokenizeStats& TokenizeStats::operator += (const TokenizeStats& other)
+	{
+		lines += other.lines;
+		bytes += other.bytes;
+		longest_line = std::max(longest_line, other.longest_line);
+		for (size_t i = 0; i < N_TOKENS; ++i) {
+			tokens[i] += other.tokens[i];
+			token_bytes[i] += other.token_bytes[i];
+		}
+		string_lines += other.string_lines;
+		longest_string = std::max(longest_string, other.longest_string);
+		string_time += other.string_time;
+		indent_time += other.indent_time;
+		scan_time += other.scan_time;
+		allocations += other.allocations;
+		allocated_bytes += other.allocated_bytes;
+		return *this;
+	}
+
+	std::ostream& operator << (std::ostream& stream, const TokenizeStats& stats)
+	{
+		stream << "lines=" << stats.lines << " bytes=" << stats.bytes << " longest_line=" << stats.longest_line
+			<< " string_lines=" << stats.string_lines << " longest_string=" << stats.longest_string
+			<< " string_time=" << stats.string_time.count() << "ns indent_time=" << stats.indent_time.count()
+			<< "ns scan_time=" << stats.scan_time.count() << "ns allocations=" << stats.allocations
+			<< " allocated_bytes=" << stats.allocated_bytes;
+		for (size_t i = 0; i < N_TOKENS; ++i) {
+			if (stats.tokens[i])
+				stream << ' ' << to_string(Token(i)) << '=' << stats.tokens[i] << '/' << stats.token_bytes[i];
+		}
+		return stream;
+	}
+
+	namespace stats
+	{
+#ifdef TOKENIZE_STATS
+		// Passes allocations on to another resource, counting them
+		class Counters : public std::pmr::memory_resource
+		{
+		public:
+			explicit Counters(std::pmr::memory_resource* upstream)
+				: upstream(upstream)
+			{
+			}
+
+			TokenizeStats stats;
+
+		private:
+			void* do_allocate(size_t bytes, size_t alignment) override
+			{
+				++stats.allocations;
+				stats.allocated_bytes += bytes;
+				return upstream->allocate(bytes, alignment);
+			}
+
+			void do_deallocate(void* p, size_t bytes, size_t alignment) override
+			{
+				upstream->deallocate(p, bytes, alignment);
+			}
+
+			bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+			{
+				return this == &other;
+			}
+
+			std::pmr::memory_resource* upstream;
+		};
+
+		// Charges the time from when each phase of a line is entered until
+		// the next one, or the end of the line, to the counter for it
+		class Phase
+		{
+		public:
+			explicit Phase(TokenizeStats& stats)
+				: stats(stats)
+				, counter(nullptr)
+			{
+			}
+
+			~Phase()
+			{
+				enter(nullptr);
+			}
+
+			void enter(std::chrono::nanoseconds TokenizeStats::* next)
+			{
+				auto now = std::chrono::steady_clock::now();
+				if (counter)
+					stats.*counter += now - start;
+				counter = next;
+				start = now;
+			}
+
+		private:
+			TokenizeStats& stats;
+			std::chrono::nanoseconds TokenizeStats::* counter;
+			std::chrono::steady_clock::time_point start;
+		};
+#endif
+
+		// Makes the counters of a tokenizer, pointing resource at one which
+		// counts the allocations made from it, or returns null unless built
+		// with TOKENIZE_STATS
+		std::shared_ptr<TokenizeStats> counted(std::pmr::memory_resource*& resource)
+		{
+#ifdef TOKENIZE_STATS
+			auto counters = std::make_shared<Counters>(resource);
+			resource = counters.get();
+			return std::shared_ptr<TokenizeStats>(counters, &counters->stats);
+#else
+			(void)resource;
+			return nullptr;
+#endif
+		}
+
+		void count_token(TokenizeStats& stats, const TokenView& token)
+		{
+			if (token.exact < N_TOKENS) {
+				++stats.tokens[token.exact];
+				stats.token_bytes[token.exact] += token.token.size();
+			}
+		}
+	}
+
+#ifdef TOKENIZE_STATS
+#define TOKENIZE_STATS_ONLY(...) __VA_ARGS__
+#else
+#define TOKENIZE_STATS_ONLY(...)
+#endif
+
+	// Marks where the indentation of a logical line is to be checked when a
+	// Tokenizer leaves the INDENT and DEDENT tokens to its caller. This is
+	// never a real token type.
+	const Token INDENTATION = NT_OFFSET;
+
+	size_t indent_column(std::string_view prefix)
+	{
+		size_t column = 0;
+		for (char c : prefix) {
+			if (c == ' ')
+				++column;
+			else if (c == '\t')
+				column = (column / tabsize + 1) * tabsize;
+			else if (c == '\f')
+				column = 0;
+		}
+		return column;
+	}
+
+	// Emits the INDENT or DEDENT tokens for a logical line, given the
+	// whitespace at its start. The end of the input is an empty prefix.
+	// Returns false if the line dedents to no outer level, in which case it
+	// carries on the innermost block it is still inside.
+	bool indent(std::pmr::vector<size_t>& indents, std::pmr::vector<TokenView>& tokens, const TokenView& prefix)
+	{
+		size_t column = indent_column(prefix.token);
+		if (column > indents.back()) {
+			indents.push_back(column);
+			tokens.emplace_back(INDENT, prefix.token, prefix.start, prefix.end, prefix.line);
+		}
+		while (column < indents.back()) {
+			if (column > indents[indents.size() - 2]) {
+				indents.back() = column;
+				return false;
+			}
+			indents.pop_back();
+			tokens.emplace_back(DEDENT, "", prefix.end, prefix.end, prefix.line);
+		}
+		return true;
+	}
+
+	Tokenizer::iterator::iterator()
+		: tokenizer(nullptr)
+	{
+
+	}
+
+	Tokenizer::iterator::iterator(Tokenizer& tokenizer)
+		: tokenizer(&tokenizer)
+		, current(tokenizer.next())
+	{
+
+	}
+
+	Tokenizer::iterator::reference Tokenizer::iterator::operator * () const
+	{
+		return *current;
+	}
+
+	Tokenizer::iterator::pointer Tokenizer::iterator::operator -> () const
+	{
+		return &*current;
+	}
+
+	Tokenizer::iterator& Tokenizer::iterator::operator ++ ()
+	{
+		current = tokenizer->next();
+		return *this;
+	}
+
+	bool Tokenizer::iterator::operator == (const iterator& other) const
+	{
+		return !current && !other.current;
+	}
+
+	bool Tokenizer::iterator::operator != (const iterator& other) const
+	{
+		return !(*this == other);
+	}
+
+	Tokenizer::Tokenizer(std::istream& stream, std::pmr::memory_resource* resource)
+		: Tokenizer(std::string_view(), "utf-8", 0, resource)
+	{
+		auto detected = detect_encoding(stream);
+		const auto& codec = codecs::lookup(detected.first);
+		encoding = codec.name;
+		pending.front().token = codecs::token_name(encoding);
+		if (codec.kind == codecs::UTF_16_LE || codec.kind == codecs::UTF_16_BE) {
+			// The lines of UTF-16 can't be found before decoding it, so the
+			// whole of the stream is decoded and tokenized from memory
+			for (const auto& line : detected.second)
+				input += line;
+			input.append(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+			codecs::decode(input, codec, buffer);
+			text = buffer;
+			limit = buffer.size();
+			return;
+		}
+		this->stream = &stream;
+		lookahead = std::move(detected.second);
+	}
+
+	Tokenizer::Tokenizer(std::string_view source, std::pmr::memory_resource* resource)
+		: Tokenizer(std::string_view(), "utf-8", 0, resource)
+	{
+		position = codecs::decode_source(source, encoding, text, input);
+		limit = text.size();
+		pending.front().token = codecs::token_name(encoding);
+	}
+
+	Tokenizer::Tokenizer(std::string_view text, std::string_view encoding, size_t position,
+		std::pmr::memory_resource* resource)
+		: counters(stats::counted(resource))
+		, stream(nullptr)
+		, encoding(encoding)
+		, input(resource)
+		, buffer(resource)
+		, text(text)
+		, position(position)
+		, limit(text.size())
+		, partial(false)
+		, defer_indents(false)
+		, emitted(0)
+		, mask(TokenMask().set())
+		, masked(false)
+		, pushed(resource)
+		, consumed(0)
+		, pushing(false)
+		, detected(true)
+		, closed(false)
+		, waiting(false)
+		, diagnostics(nullptr)
+		, recovery(Recovery::STOP)
+		, pending(resource)
+		, index(0)
+		, done(false)
+		, lnum(0)
+		, parenlev(0)
+		, continued(0)
+		, contstr(std::string_view::npos)
+		, needcont(0)
+		, contline(std::string_view::npos)
+		, indents(1, 0, resource)
+		, endquote(0)
+		, endtriple(false)
+	{
+		pending.emplace_back(ENCODING, codecs::token_name(encoding), std::pair<size_t, size_t>(0, 0), std::pair<size_t, size_t>(0, 0), "");
+	}
+
+	Tokenizer::Tokenizer(const TokenizeLimits& limits, std::pmr::memory_resource* resource)
+		: Tokenizer(std::string_view(), "utf-8", 0, resource)
+	{
+		this->limits = limits;
+		pushing = true;
+		detected = false;
+		// The ENCODING token is only known once the first lines are pushed
+		pending.clear();
+	}
+
+	void Tokenizer::push(std::string_view chunk)
+	{
+		if (!pushing || closed)
+			throw std::logic_error("input can't be pushed to this tokenizer");
+		pushed += chunk;
+	}
+
+	void Tokenizer::close()
+	{
+		if (!pushing)
+			throw std::logic_error("input can't be pushed to this tokenizer");
+		closed = true;
+	}
+
+	bool Tokenizer::needs_input() const
+	{
+		return waiting;
+	}
+
+	void Tokenizer::set_limits(const TokenizeLimits& limits)
+	{
+		this->limits = limits;
+	}
+
+	void Tokenizer::set_mask(const TokenMask& mask)
+	{
+		this->mask = mask;
+		masked = !mask.all();
+		// The ENCODING token may already be pending
+		if (masked)
+			drop_masked();
+	}
+
+	// Drops the pending tokens which aren't in the mask
+	void Tokenizer::drop_masked()
+	{
+		pending.erase(std::remove_if(pending.begin() + index, pending.end(), [&](const TokenView& token) {
+			return !mask[token.type] && !mask[token.exact];
+		}), pending.end());
+	}
+
+	void Tokenizer::report(std::vector<Diagnostic>& diagnostics, Recovery recovery)
+	{
+		this->diagnostics = &diagnostics;
+		this->recovery = recovery;
+	}
+
+	// Throws an error in the source, or adds it to the diagnostics if they
+	// are being reported. Returns whether tokenizing carries on past it.
+	bool Tokenizer::fail(Diagnostic::Kind kind, const char* message, const std::pair<size_t, size_t>& position)
+	{
+		Diagnostic diagnostic{ kind, message, position, parenlev, indents.size() - 1,
+			contstr != std::string_view::npos, diagnostics && recovery == Recovery::CONTINUE };
+		if (!diagnostics)
+			helpers::raise(diagnostic);
+		diagnostics->push_back(std::move(diagnostic));
+		if (recovery == Recovery::STOP)
+			done = true;
+		return !done;
+	}
+
+	std::optional<TokenView> Tokenizer::next()
+	{
+		waiting = false;
+		if (index == pending.size()) {
+			pending.clear();
+			index = 0;
+			while (pending.empty() && !done) {
+				size_t offset;
+				std::string_view line;
+				if (!read_line(offset, line)) {
+					waiting = pending.empty();
+					break;
+				}
+				if (partial && line.empty()) {
+					done = true;
+				}
+				else if (!tokenize_line(offset, line)) {
+					finish();
+					done = true;
+				}
+				// The tokens of each line are dropped as soon as it is
+				// scanned, so that only those in the mask are ever kept
+				if (masked)
+					drop_masked();
+			}
+			if (pending.empty())
+				return std::nullopt;
+			emitted += pending.size();
+			if (emitted > limits.max_tokens)
+				throw LimitError(LimitError::TOKENS, "too many tokens", pending.back().start);
+			TOKENIZE_STATS_ONLY(for (const auto& token : pending) stats::count_token(*counters, token);)
+		}
+		return pending[index++];
+	}
+
+	const TokenizeStats* Tokenizer::stats() const
+	{
+		return counters.get();
+	}
+
+	Tokenizer::iterator Tokenizer::begin()
+	{
+		return iterator(*this);
+	}
+
+	Tokenizer::iterator Tokenizer::end()
+	{
+		return iterator();
+	}
+
+	// Reads the next physical line including its terminator, or an empty
+	// line once the end of the input has been reached. Returns false if the
+	// line hasn't all been pushed yet.
+	bool Tokenizer::read_line(size_t& offset, std::string_view& line)
+	{
+		if (pushing) {
+			if (!detected && !detect_pushed())
+				return false;
+			if (!take_pushed())
+				return false;
+		}
+		if (stream || pushing) {
+			// The lines read while detecting the encoding come first
+			if (!lookahead.empty()) {
+				input = lookahead.front();
+				lookahead.erase(lookahead.begin());
+			}
+			else if (pushing ? !input.empty() : limits.max_line == SIZE_MAX ? bool(std::getline(*stream, input)) : read_limited()) {
+				if (!pushing && !stream->eof())
+					input += '\n';
+			}
+			else {
+				offset = buffer.size();
+				line = std::string_view();
+				return true;
+			}
+			// Only the lines of a string which is still being continued need
+			// to be kept, as the tokens handed out so far are no longer valid
+			if (contstr == std::string_view::npos)
+				buffer.clear();
+			offset = buffer.size();
+			if (encoding == "utf-8" || encoding == "utf-8-sig") {
+				codecs::check_utf8(input, 0, lnum + 1);
+				buffer += input;
+			}
+			else
+				codecs::decode(input, codecs::lookup(std::string(encoding)), buffer);
+			text = buffer;
+			line = text.substr(offset);
+			return true;
+		}
+
+		offset = position;
+		size_t end = limit;
+		if (position < limit) {
+			auto newline = static_cast<const char*>(std::memchr(text.data() + position, '\n', limit - position));
+			if (newline)
+				end = newline - text.data() + 1;
+		}
+		line = text.substr(position, end - position);
+		position = end;
+		return true;
+	}
+
+	// Reads a line from the stream into input in the same way as getline(),
+	// but without reading more of it than limits.max_line allows
+	bool Tokenizer::read_limited()
+	{
+		input.clear();
+		std::istream::sentry sentry(*stream, true);
+		if (!sentry)
+			return false;
+		auto buffer = stream->rdbuf();
+		for (;;) {
+			auto c = buffer->sbumpc();
+			if (c == std::char_traits<char>::eof()) {
+				stream->setstate(input.empty() ? std::ios::eofbit | std::ios::failbit : std::ios::eofbit);
+				return !input.empty();
+			}
+			if (input.size() + 1 > limits.max_line)
+				throw LimitError(LimitError::LINE, "line too long", std::make_pair(lnum + 1, input.size()));
+			if (c == '\n')
+				return true;
+			input += std::char_traits<char>::to_char_type(c);
+		}
+	}
+
+	// Moves the next line which has been pushed into input, which is left
+	// empty at the end of the input. Returns false if the line hasn't all
+	// been pushed yet.
+	bool Tokenizer::take_pushed()
+	{
+		input.clear();
+		size_t newline = pushed.find('\n', consumed);
+		if (newline == std::string::npos) {
+			if (pushed.size() - consumed > limits.max_line)
+				throw LimitError(LimitError::LINE, "line too long", std::make_pair(lnum + 1, limits.max_line));
+			if (!closed)
+				return false;
+		}
+		size_t end = newline == std::string::npos ? pushed.size() : newline + 1;
+		if (end - consumed > limits.max_line)
+			throw LimitError(LimitError::LINE, "line too long", std::make_pair(lnum + 1, limits.max_line));
+		input.assign(pushed, consumed, end - consumed);
+		consumed = end;
+		// The lines which have been read are dropped once they make up half
+		// of what was pushed, so that moving the rest down is amortised
+		if (consumed * 2 >= pushed.size()) {
+			pushed.erase(0, consumed);
+			consumed = 0;
+		}
+		return true;
+	}
+
+	// Works out the encoding of the pushed input once as many of its first
+	// two lines as are needed have been pushed, and adds the ENCODING token.
+	// Returns false if it is still waiting for them.
+	bool Tokenizer::detect_pushed()
+	{
+		bool incomplete = false;
+		size_t at = 0;
+		char storage[4 * sizeof(std::string_view)];
+		std::pmr::monotonic_buffer_resource arena(storage, sizeof(storage));
+		std::pmr::vector<std::string_view> lines(&arena);
+		lines.reserve(2);
+		auto name = codecs::detect([&](std::string_view& line) {
+			size_t newline = pushed.find('\n', at);
+			if (newline == std::string::npos) {
+				if (pushed.size() - at > limits.max_line)
+					throw LimitError(LimitError::LINE, "line too long", std::make_pair(lines.size() + 1, limits.max_line));
+				if (!closed) {
+					incomplete = true;
+					return false;
+				}
+				if (at == pushed.size())
+					return false;
+			}
+			size_t end = newline == std::string::npos ? pushed.size() : newline + 1;
+			line = std::string_view(pushed).substr(at, end - at);
+			at = end;
+			return true;
+		}, lines);
+		if (incomplete)
+			return false;
+		const auto& codec = codecs::lookup(name);
+		if (codec.kind == codecs::UTF_16_LE || codec.kind == codecs::UTF_16_BE)
+			throw std::runtime_error("UTF-16 input can't be pushed");
+		encoding = codec.name;
+		if (helpers::starts_with(pushed, codec.bom))
+			consumed = codec.bom.size();
+		pending.emplace_back(ENCODING, codecs::token_name(encoding), std::pair<size_t, size_t>(0, 0), std::pair<size_t, size_t>(0, 0), "");
+		detected = true;
+		return true;
+	}
+
+	// Tokenizes one physical line, returning false once the end of the
+	// input has been reached.
+	bool Tokenizer::tokenize_line(size_t offset, std::string_view line)
+	{
+		const size_t npos = std::string_view::npos;
+		const std::string_view numchars = "0123456789";
+		lnum += 1;
+		size_t pos = 0;
+		size_t max = line.size();
+		if (max > limits.max_line)
+			throw LimitError(LimitError::LINE, "line too long", std::make_pair(lnum, limits.max_line));
+		if (!line.empty())
+			last_line = line;
+		TOKENIZE_STATS_ONLY(
+			stats::Phase phase(*counters);
+			counters->lines += !line.empty();
+			counters->bytes += line.size();
+			counters->longest_line = std::max(counters->longest_line, line.size());
+		)
+
+		if (contstr != npos) {
+			if (line.empty()) {
+				if (!fail(Diagnostic::EOF_IN_STRING, "EOF in multi-line string", strstart))
+					return true;
+				// The rest of the input is the unterminated string
+				pending.emplace_back(ERRORTOKEN,
+					text.substr(contstr, offset - contstr),
+					strstart,
+					std::pair<size_t, size_t>(lnum - 1, last_line.size()),
+					text.substr(contline, offset - contline));
+				contstr = npos;
+				needcont = 0;
+				contline = npos;
+				return false;
+			}
+			TOKENIZE_STATS_ONLY(
+				phase.enter(&TokenizeStats::string_time);
+				counters->string_lines += 1;
+				counters->longest_string = std::max(counters->longest_string, lnum - strstart.first + 1);
+			)
+			size_t end = scanner::string_end(line, 0, endquote, endtriple);
+			if (offset + (end == npos ? line.size() : end) - contstr > limits.max_string)
+				throw LimitError(LimitError::STRING, "string too long", strstart);
+			if (end != npos) {
+				pos = end;
+				pending.emplace_back(STRING,
+					text.substr(contstr, offset + end - contstr),
+					strstart,
+					std::pair<size_t, size_t>(lnum, end),
+					text.substr(contline, offset + line.size() - contline));
+				contstr = npos;
+				needcont = 0;
+				contline = npos;
+			}
+			else if (needcont &&
+				!helpers::ends_with(line, "\\\n") &&
+				!helpers::ends_with(line, "\\\r\n")) {
+				pending.emplace_back(ERRORTOKEN,
+					text.substr(contstr, offset + line.size() - contstr),
+					strstart,
+					std::pair<size_t, size_t>(lnum, line.size()),
+					text.substr(contline, offset - contline));
+				contstr = npos;
+				contline = npos;
+				return true;
+			}
+			else {
+				// contstr and contline extend over this line
+				return true;
+			}
+		}
+		else if (parenlev == 0 && !continued) {
+			if (line.empty())
+				return false;
+			TOKENIZE_STATS_ONLY(phase.enter(&TokenizeStats::indent_time);)
+			while (pos < max && (line[pos] == ' ' || line[pos] == '\t' || line[pos] == '\f'))
+				++pos;
+			if (pos == max)
+				return false;
+
+			if (line[pos] == '#' || line[pos] == '\r' || line[pos] == '\n') {
+				if (line[pos] == '#') {
+					auto comment_token = helpers::rstrip(line.substr(pos), "\r\n");
+					pending.emplace_back(COMMENT,
+						comment_token,
+						std::make_pair(lnum, pos),
+						std::make_pair(lnum, pos + comment_token.size()),
+						line);
+					pos += comment_token.size();
+				}
+				pending.emplace_back(NL,
+					line.substr(pos),
+					std::make_pair(lnum, pos),
+					std::make_pair(lnum, line.size()),
+					line);
+				return true;
+			}
+			TokenView prefix(INDENT, line.substr(0, pos), std::make_pair(lnum, 0), std::make_pair(lnum, pos), line);
+			if (defer_indents)
+				pending.emplace_back(INDENTATION, prefix.token, prefix.start, prefix.end, prefix.line);
+			else if (!indent(indents, pending, prefix) &&
+				!fail(Diagnostic::BAD_DEDENT, "unindent does not match any outer indentation level", prefix.end))
+				return true;
+			if (indents.size() - 1 > limits.max_indents)
+				throw LimitError(LimitError::INDENTS, "too many levels of indentation", prefix.end);
+		}
+		else {
+			if (line.empty()) {
+				if (!fail(Diagnostic::EOF_IN_STATEMENT, "EOF in multi-line statement", std::pair<size_t, size_t>(lnum, 0)))
+					return true;
+				parenlev = 0;
+				continued = 0;
+				pending.emplace_back(NEWLINE, "", std::pair<size_t, size_t>(lnum, 0), std::pair<size_t, size_t>(lnum, 0), "");
+				return false;
+			}
+			continued = 0;
+		}
+
+		TOKENIZE_STATS_ONLY(phase.enter(&TokenizeStats::scan_time);)
+		while (pos < max) {
+			size_t start, end;
+			Token op;
+			if (scanner::pseudo_token(line, pos, start, end, op)) {
+				auto spos = std::make_pair(lnum, start);
+				auto epos = std::make_pair(lnum, end);
+				pos = end;
+				if (start == end)
+					continue;
+				auto token = line.substr(start, end - start);
+				auto initial = line[start];
+				size_t quote;
+				if (numchars.find(initial) != std::string::npos ||
+					(initial == '.' && token != "." && token != "...")) {
+					pending.emplace_back(NUMBER, token, spos, epos, line);
+				}
+				else if (initial == '\r' || initial == '\n') {
+					if (parenlev > 0)
+						pending.emplace_back(NL, token, spos, epos, line);
+					else
+						pending.emplace_back(NEWLINE, token, spos, epos, line);
+				}
+				else if (initial == '#') {
+					assert(!helpers::ends_with(token, "\n"));
+					pending.emplace_back(COMMENT, token, spos, epos, line);
+				}
+				else if ((quote = scanner::string_prefix(token, 0)) != npos && quote + 3 == token.size() &&
+						token[quote + 1] == token[quote] && token[quote + 2] == token[quote]) {
+					endquote = token[quote];
+					endtriple = true;
+					size_t end = scanner::string_end(line, pos, endquote, true);
+					if (end != npos) {
+						pos = end;
+						token = line.substr(start, pos - start);
+						pending.emplace_back(STRING, token, spos, std::make_pair(lnum, pos), line);
+					}
+					else {
+						strstart = std::make_pair(lnum, start);
+						contstr = offset + start;
+						contline = offset;
+						break;
+					}
+				}
+				else if (quote != npos) {
+					if (token.back() == '\n') {
+						strstart = std::make_pair(lnum, start);
+						endquote = token[quote];
+						endtriple = false;
+						contstr = offset + start;
+						contline = offset;
+						needcont = 1;
+						break;
+					}
+					else {
+						pending.emplace_back(STRING, token, spos, epos, line);
+					}
+				}
+				else if (scanner::name_start(line, start)) {
+					pending.emplace_back(NAME, token, spos, epos, line);
+				}
+				else if (initial == '\\') {
+					continued = 1;
+				}
+				else {
+					if (initial == '(' || initial == '[' || initial == '{') {
+						if (++parenlev > 0 && static_cast<size_t>(parenlev) > limits.max_parens)
+							throw LimitError(LimitError::PARENS, "too many nested parentheses", spos);
+					}
+					else if (initial == ')' || initial == ']' || initial == '}') {
+						--parenlev;
+					}
+					pending.emplace_back(OP, token, spos, epos, line, op);
+				}
+			}
+			else {
+				// The whole of a character which isn't ASCII is in error
+				uint32_t cp;
+				size_t n = std::max<size_t>(1, decode_utf8(line, pos, cp));
+				pending.emplace_back(ERRORTOKEN,
+					line.substr(pos, n),
+					std::make_pair(lnum, pos),
+					std::make_pair(lnum, pos + n),
+					line);
+				pos += n;
+			}
+		}
+		return true;
+	}
+
+	void Tokenizer::finish()
+	{
+		// Add an implicit NEWLINE if the input doesn't end in a newline
+		if (!last_line.empty() && last_line.back() != '\r' && last_line.back() != '\n' &&
+			!helpers::starts_with(helpers::lstrip(last_line, " \t\n\r\f\v"), "#"))
+			pending.emplace_back(NEWLINE,
+				"",
+				std::make_pair(lnum - 1, last_line.size()),
+				std::make_pair(lnum - 1, last_line.size() + 1),
+				"");
+		TokenView prefix(INDENT, "", std::make_pair(lnum, 0), std::make_pair(lnum, 0), "");
+		if (defer_indents)
+			pending.emplace_back(INDENTATION, prefix.token, prefix.start, prefix.end, prefix.line);
+		else
+			indent(indents, pending, prefix);
+		pending.emplace_back(ENDMARKER,
+			"",
+			std::make_pair(lnum, 0),
+			std::make_pair(lnum, 0),
+			"");
+	}
+
+	bool Tokenizer::at_top_level() const
+	{
+		return contstr == std::string_view::npos && parenlev == 0 && !continued;
+	}
+
+	void Tokenizer::resume(const Tokenizer& previous)
+	{
+		parenlev = previous.parenlev;
+		continued = previous.continued;
+		contstr = previous.contstr;
+		needcont = previous.needcont;
+		contline = previous.contline;
+		endquote = previous.endquote;
+		endtriple = previous.endtriple;
+		strstart = previous.strstart;
+	}
+
+	// Starts on another buffer of UTF-8 text, keeping the memory which has
+	// been allocated for the last one
+	void Tokenizer::restart(std::string_view text, std::string_view encoding, size_t position)
+	{
+		this->text = text;
+		this->encoding = encoding;
+		this->position = position;
+		limit = text.size();
+		pending.clear();
+		index = 0;
+		done = false;
+		emitted = 0;
+		lnum = 0;
+		parenlev = 0;
+		continued = 0;
+		contstr = std::string_view::npos;
+		needcont = 0;
+		contline = std::string_view::npos;
+		indents.resize(1);
+		endquote = 0;
+		endtriple = false;
+		last_line = std::string_view();
+		pending.emplace_back(ENCODING, codecs::token_name(encoding), std::pair<size_t, size_t>(0, 0), std::pair<size_t, size_t>(0, 0), "");
+		if (masked)
+			drop_masked();
+	}
+
+	// Works out the encoding of a buffer, returning the UTF-8 text to
+	// tokenize. This is the buffer itself unless it had to be transcoded, in
+	// which case storage is set to keep the transcoded text alive.
+	std::string_view decode_buffer(std::string_view source, std::string_view& encoding, size_t& position,
+		std::shared_ptr<const void>& storage, std::pmr::memory_resource* resource)
+	{
+		std::pmr::string decoded(resource);
+		std::string_view text;
+		position = codecs::decode_source(source, encoding, text, decoded);
+		if (text.data() == source.data())
+			return source;
+		auto owned = std::make_shared<const std::pmr::string>(std::move(decoded));
+		storage = owned;
+		return *owned;
+	}
+
+	TokenStream tokenize_views(std::istream& stream, std::pmr::memory_resource* resource)
+	{
+		// The whole stream is read into one buffer which all of the views
+		// refer into
+		auto source = std::allocate_shared<std::pmr::string>(std::pmr::polymorphic_allocator<std::pmr::string>(resource),
+			std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+		auto tokens = tokenize_views(*source, resource);
+		if (!tokens.storage)
+			tokens.storage = source;
+		return tokens;
+	}
+
+	TokenStream tokenize_views(std::string_view source, std::pmr::memory_resource* resource)
+	{
+		std::shared_ptr<const void> storage;
+		std::string_view encoding;
+		size_t position;
+		auto text = decode_buffer(source, encoding, position, storage, resource);
+		std::pmr::vector<TokenView> tokens(resource);
+		Tokenizer tokenizer(text, encoding, position, resource);
+		while (auto token = tokenizer.next()) {
+			TOKENIZE_STATS_ONLY(size_t capacity = tokens.capacity();)
+			tokens.push_back(*token);
+			TOKENIZE_STATS_ONLY(
+				if (tokens.capacity() != capacity) {
+					tokenizer.counters->allocations += 1;
+					tokenizer.counters->allocated_bytes += tokens.capacity() * sizeof(TokenView);
+				}
+			)
+		}
+		return { storage, text, std::move(tokens), tokenizer.counters };
+	}
+
+	TokenStream tokenize_file(const std::string& path, std::pmr::memory_resource* resource)
+	{
+		auto file = std::make_shared<helpers::MappedFile>(path);
+		auto tokens = tokenize_views(file->view(), resource);
+		if (!tokens.storage)
+			tokens.storage = file;
+		return tokens;
+	}
+
+	// The format written by write_tokens. A header of
+	//
+	//     magic, version: 4 bytes each
+	//     hash and size of the source, token count: 8 bytes each
+	//     encoding: 4 byte length then its name
+	//
+	// with each number little endian, is followed by a record for each token
+	// of varints:
+	//
+	//     exact type
+	//     start row less the previous start row, start column
+	//     end row less the start row, end column
+	//     length of the text, then if it isn't empty its offset less the end
+	//     of the previous text as a signed varint
+	//     the same for the line
+	//
+	// Only the ENCODING token's text isn't in the source, which is the name
+	// of the encoding from the header.
+	namespace token_file
+	{
+		const char magic[4] = { 'P', 'Y', 'T', 'K' };
+		// Increased whenever the format or the tokens made for a source change
+		const uint32_t version = 1;
+		const size_t header_size = 4 + 4 + 8 + 8 + 8 + 4;
+
+		void put_fixed(std::string& out, uint64_t n, size_t bytes)
+		{
+			for (size_t i = 0; i < bytes; ++i)
+				out += char(n >> (8 * i));
+		}
+
+		uint64_t get_fixed(const char* p, size_t bytes)
+		{
+			uint64_t n = 0;
+			for (size_t i = 0; i < bytes; ++i)
+				n |= uint64_t(static_cast<unsigned char>(p[i])) << (8 * i);
+			return n;
+		}
+
+		void put_varint(std::string& out, uint64_t n)
+		{
+			while (n >= 0x80) {
+				out += char(n | 0x80);
+				n >>= 7;
+			}
+			out += char(n);
+		}
+
+		void put_signed(std::string& out, int64_t n)
+		{
+			put_varint(out, (uint64_t(n) << 1) ^ uint64_t(n >> 63));
+		}
+
+		uint64_t get_varint(const char*& p, const char* end)
+		{
+			uint64_t n = 0;
+			for (unsigned shift = 0; p != end && shift < 64; shift += 7) {
+				unsigned char c = *p++;
+				n |= uint64_t(c & 0x7f) << shift;
+				if (!(c & 0x80))
+					return n;
+			}
+			throw std::runtime_error("corrupt token file");
+		}
+
+		int64_t get_signed(const char*& p, const char* end)
+		{
+			uint64_t n = get_varint(p, end);
+			return int64_t(n >> 1) ^ -int64_t(n & 1);
+		}
+
+		// Appends the length of a view into source and, unless it is empty,
+		// its offset less base
+		void put_span(std::string& out, std::string_view source, std::string_view view, size_t base)
+		{
+			put_varint(out, view.size());
+			if (view.empty())
+				return;
+			if (view.data() < source.data() || view.data() + view.size() > source.data() + source.size())
+				throw std::invalid_argument("token is not in the source");
+			put_signed(out, int64_t(view.data() - source.data()) - int64_t(base));
+		}
+
+		std::string_view get_span(const char*& p, const char* end, std::string_view source, size_t base)
+		{
+			size_t size = get_varint(p, end);
+			if (!size)
+				return std::string_view();
+			size_t offset = base + get_signed(p, end);
+			if (offset > source.size() || size > source.size() - offset)
+				throw std::runtime_error("corrupt token file");
+			return source.substr(offset, size);
+		}
+	}
+
+	TokenFile::const_iterator::const_iterator(const TokenFile* tokens, size_t i)
+		: tokens(tokens)
+		, i(i)
+		, record(tokens->records.data())
+		, row(0)
+		, token_end(0)
+		, line_begin(0)
+	{
+		if (i < tokens->count)
+			decode();
+	}
+
+	void TokenFile::const_iterator::decode()
+	{
+		const char* end = tokens->records.data() + tokens->records.size();
+		auto exact = Token(token_file::get_varint(record, end));
+		std::pair<size_t, size_t> start, finish;
+		start.first = row += token_file::get_signed(record, end);
+		start.second = token_file::get_varint(record, end);
+		finish.first = start.first + token_file::get_varint(record, end);
+		finish.second = token_file::get_varint(record, end);
+		auto token = token_file::get_span(record, end, tokens->source, token_end);
+		auto line = token_file::get_span(record, end, tokens->source, line_begin);
+		if (!token.empty())
+			token_end = token.data() - tokens->source.data() + token.size();
+		if (!line.empty())
+			line_begin = line.data() - tokens->source.data();
+		if (exact == ENCODING)
+			token = tokens->encoding;
+		auto type = exact >= LPAR && exact <= OP ? OP : exact;
+		current.emplace(type, token, start, finish, line, exact);
+	}
+
+	TokenFile::const_iterator::reference TokenFile::const_iterator::operator * () const
+	{
+		return *current;
+	}
+
+	TokenFile::const_iterator::pointer TokenFile::const_iterator::operator -> () const
+	{
+		return &*current;
+	}
+
+	TokenFile::const_iterator& TokenFile::const_iterator::operator ++ ()
+	{
+		if (++i < tokens->count)
+			decode();
+		else
+			current.reset();
+		return *this;
+	}
+
+	TokenFile::const_iterator TokenFile::const_iterator::operator ++ (int)
+	{
+		auto copy = *this;
+		++*this;
+		return copy;
+	}
+
+	bool TokenFile::const_iterator::operator == (const const_iterator& other) const
+	{
+		return i == other.i;
+	}
+
+	bool TokenFile::const_iterator::operator != (const const_iterator& other) const
+	{
+		return i != other.i;
+	}
+
+	TokenFile::TokenFile(const std::string& path, std::string_view source)
+		: source(source)
+	{
+		auto mapped = std::make_shared<helpers::MappedFile>(path);
+		auto data = mapped->view();
+		if (data.size() < token_file::header_size ||
+			data.substr(0, 4) != std::string_view(token_file::magic, 4) ||
+			token_file::get_fixed(data.data() + 4, 4) != token_file::version)
+			throw std::runtime_error(path + " is not a token file of this version");
+		if (token_file::get_fixed(data.data() + 8, 8) != helpers::hash(source) ||
+			token_file::get_fixed(data.data() + 16, 8) != source.size())
+			throw std::runtime_error(path + " was written for another source");
+		count = token_file::get_fixed(data.data() + 24, 8);
+		size_t length = token_file::get_fixed(data.data() + 32, 4);
+		if (length > data.size() - token_file::header_size)
+			throw std::runtime_error("corrupt token file");
+		encoding = data.substr(token_file::header_size, length);
+		records = data.substr(token_file::header_size + length);
+		file = mapped;
+	}
+
+	TokenFile::const_iterator TokenFile::begin() const
+	{
+		return const_iterator(this, 0);
+	}
+
+	TokenFile::const_iterator TokenFile::end() const
+	{
+		return const_iterator(this, count);
+	}
+
+	size_t TokenFile::size() const
+	{
+		return count;
+	}
+
+	void write_tokens(const TokenStream& tokens, std::ostream& out)
+	{
+		std::string_view encoding = "utf-8";
+		if (!tokens.tokens.empty() && tokens.tokens.front().type == ENCODING)
+			encoding = tokens.tokens.front().token;
+
+		std::string data(token_file::magic, 4);
+		token_file::put_fixed(data, token_file::version, 4);
+		token_file::put_fixed(data, helpers::hash(tokens.source), 8);
+		token_file::put_fixed(data, tokens.source.size(), 8);
+		token_file::put_fixed(data, tokens.size(), 8);
+		token_file::put_fixed(data, encoding.size(), 4);
+		data += encoding;
+
+		// The text of a token is placed relative to the end of the previous
+		// token's, and its line relative to the start of the previous line as
+		// most tokens share the line of the one before
+		size_t row = 0, token_end = 0, line_begin = 0;
+		for (const auto& token : tokens) {
+			auto text = token.type == ENCODING ? std::string_view() : token.token;
+			token_file::put_varint(data, token.exact);
+			token_file::put_signed(data, int64_t(token.start.first) - int64_t(row));
+			token_file::put_varint(data, token.start.second);
+			token_file::put_varint(data, token.end.first - token.start.first);
+			token_file::put_varint(data, token.end.second);
+			token_file::put_span(data, tokens.source, text, token_end);
+			token_file::put_span(data, tokens.source, token.line, line_begin);
+			if (!text.empty())
+				token_end = text.data() - tokens.source.data() + text.size();
+			if (!token.line.empty())
+				line_begin = token.line.data() - tokens.source.data();
+			row = token.start.first;
+		}
+		out.write(data.data(), data.size());
+	}
+
+	TokenFile tokenize_cached(std::string_view source, const std::string& directory)
+	{
+		std::shared_ptr<const void> storage;
+		std::string_view encoding;
+		size_t position;
+		auto text = decode_buffer(source, encoding, position, storage, std::pmr::get_default_resource());
+
+		char name[21];
+		std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(helpers::hash(text)));
+		auto path = directory + "/" + name + ".tokens";
+		try {
+			TokenFile tokens(path, text);
+			tokens.storage = storage;
+			return tokens;
+		}
+		catch (const std::runtime_error&) {
+			// Not cached yet, or by another version
+		}
+
+		// The file is written under a name of its own and then renamed, so
+		// that a process reading it never sees it half written
+		TokenStream tokens = { storage, text, std::pmr::vector<TokenView>() };
+		Tokenizer tokenizer(text, encoding, position, std::pmr::get_default_resource());
+		while (auto token = tokenizer.next())
+			tokens.tokens.push_back(*token);
+		std::snprintf(name, sizeof(name), ".%llx", static_cast<unsigned long long>(
+			std::hash<std::thread::id>()(std::this_thread::get_id())));
+		auto temporary = path + name;
+		{
+			std::ofstream out(temporary, std::ios::binary);
+			write_tokens(tokens, out);
+			if (!out.flush())
+				throw std::runtime_error("could not write " + temporary);
+		}
+		if (std::rename(temporary.c_str(), path.c_str()) != 0)
+			std::remove(temporary.c_str());
+		TokenFile result(path, text);
+		result.storage = storage;
+		return result;
+	}
+
+	// import keyword, token
+	// print(', '.join(f'"{k}"' for k in keyword.kwlist))
+	// print(', '.join(f'"{k}"' for k, v in sorted(token.EXACT_TOKEN_TYPES.items(), key=lambda kv: kv[1])))
+	const std::string_view keyword_names[] = { "False", "None", "True", "and", "as", "assert", "async", "await", "break", "class", "continue", "def", "del", "elif", "else", "except", "finally", "for", "from", "global", "if", "import", "in", "is", "lambda", "nonlocal", "not", "or", "pass", "raise", "return", "try", "while", "with", "yield" };
+	const std::string_view operator_names[] = { "(", ")", "[", "]", ":", ",", ";", "+", "-", "*", "/", "|", "&", "<", ">", "=", ".", "%", "{", "}", "==", "!=", "<=", ">=", "~", "^", "<<", ">>", "**", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "<<=", ">>=", "**=", "//", "//=", "@", "@=", "->", "...", ":=" };
+
+	struct SymbolTable::Shard
+	{
+		std::mutex mutex;
+		std::unordered_map<std::string_view, uint32_t> index;
+		// The text of each symbol is copied into blocks which are never
+		// moved, so the views in the index and the names stay valid
+		std::vector<std::unique_ptr<char[]>> blocks;
+		size_t used = 0;
+		size_t available = 0;
+	};
+
+	namespace symbols
+	{
+		const size_t first_segment = 64;
+
+		// Symbol i is at offset i + 64 - 2^(k + 6) of segment k, where 2^(k + 6)
+		// is the highest power of two in i + 64
+		std::pair<size_t, size_t> locate(uint32_t symbol)
+		{
+			uint64_t v = uint64_t(symbol) + first_segment;
+			size_t top = 32;
+			while (!(v >> top))
+				--top;
+			return { top - 6, size_t(v - (uint64_t(1) << top)) };
+		}
+
+		// The symbol of a keyword or operator, which every table shares
+		uint32_t predefined(std::string_view text)
+		{
+			size_t keyword = scanner::match_keyword(text);
+			if (keyword != std::string_view::npos)
+				return uint32_t(keyword);
+			Token exact;
+			if (!text.empty() && scanner::match_operator(text, exact) == text.size())
+				return SymbolTable::symbol(exact);
+			return SymbolTable::none;
+		}
+	}
+
+	SymbolTable::SymbolTable(size_t shards)
+		: count(std::max<size_t>(1, shards))
+		, shards(new Shard[count])
+		, next(0)
+	{
+		for (auto& segment : names)
+			segment = nullptr;
+		// The keywords and operators refer to the tables above
+		names[0] = new std::string_view[symbols::first_segment];
+		names[1] = new std::string_view[2 * symbols::first_segment];
+		for (auto name : keyword_names)
+			names[0][next++] = name;
+		for (auto name : operator_names) {
+			auto at = symbols::locate(next++);
+			names[at.first][at.second] = name;
+		}
+	}
+
+	SymbolTable::~SymbolTable()
+	{
+		for (auto& segment : names)
+			delete[] segment.load();
+	}
+
+	uint32_t SymbolTable::intern(std::string_view text)
+	{
+		uint32_t symbol = symbols::predefined(text);
+		if (symbol != none)
+			return symbol;
+
+		auto& shard = shards[std::hash<std::string_view>()(text) % count];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto found = shard.index.find(text);
+		if (found != shard.index.end())
+			return found->second;
+
+		if (shard.blocks.empty() || text.size() > shard.available) {
+			size_t size = std::max<size_t>(4096, text.size());
+			shard.blocks.emplace_back(new char[size]);
+			shard.used = 0;
+			shard.available = size;
+		}
+		char* copy = shard.blocks.back().get() + shard.used;
+		std::memcpy(copy, text.data(), text.size());
+		shard.used += text.size();
+		shard.available -= text.size();
+		std::string_view name(copy, text.size());
+
+		symbol = next++;
+		if (symbol == none)
+			throw std::length_error("too many symbols");
+		auto at = symbols::locate(symbol);
+		auto* segment = names[at.first].load(std::memory_order_acquire);
+		if (!segment) {
+			// Whichever thread installs the segment first wins
+			auto* fresh = new std::string_view[symbols::first_segment << at.first];
+			if (names[at.first].compare_exchange_strong(segment, fresh, std::memory_order_acq_rel))
+				segment = fresh;
+			else
+				delete[] fresh;
+		}
+		segment[at.second] = name;
+		shard.index.emplace(name, symbol);
+		return symbol;
+	}
+
+	uint32_t SymbolTable::find(std::string_view text) const
+	{
+		uint32_t symbol = symbols::predefined(text);
+		if (symbol != none)
+			return symbol;
+
+		auto& shard = shards[std::hash<std::string_view>()(text) % count];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto found = shard.index.find(text);
+		return found != shard.index.end() ? found->second : none;
+	}
+
+	std::string_view SymbolTable::name(uint32_t symbol) const
+	{
+		auto at = symbols::locate(symbol);
+		return names[at.first].load(std::memory_order_acquire)[at.second];
+	}
+
+	size_t SymbolTable::size() const
+	{
+		return next;
+	}
+
+	bool SymbolTable::is_keyword(uint32_t symbol)
+	{
+		return symbol < keywords;
+	}
+
+	uint32_t SymbolTable::symbol(Token exact)
+	{
+		if (exact < LPAR || exact > COLONEQUAL)
+			return none;
+		return keywords + (exact - LPAR);
+	}
+
+	struct TokenCache::Shard
+	{
+		struct Entry
+		{
+			uint64_t hash;
+			size_t bytes;
+			std::shared_ptr<const std::string> source;
+			std::shared_ptr<const TokenStream> tokens;
+		};
+
+		std::mutex mutex;
+		// The most recently used entry is at the front
+		std::list<Entry> entries;
+		std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+		size_t bytes = 0;
+	};
+
+	TokenCache::TokenCache(size_t capacity, size_t shards)
+		: capacity(capacity)
+		, count(std::max<size_t>(1, shards))
+		, shards(new Shard[count])
+		, hit_count(0)
+		, miss_count(0)
+		, eviction_count(0)
+	{
+	}
+
+	TokenCache::~TokenCache() = default;
+
+	std::shared_ptr<const TokenStream> TokenCache::tokenize(std::string_view source)
+	{
+		const uint64_t hash = helpers::hash(source);
+		auto& shard = shards[hash % count];
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto found = shard.index.find(hash);
+			// Sources are compared as well in case of a collision
+			if (found != shard.index.end() && *found->second->source == source) {
+				shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+				++hit_count;
+				return found->second->tokens;
+			}
+		}
+		++miss_count;
+
+		// Tokenized without the lock held, so that a large source doesn't
+		// hold up the other threads using the shard
+		auto copy = std::make_shared<const std::string>(source);
+		auto tokens = std::make_shared<TokenStream>(tokenize_views(*copy));
+		if (!tokens->storage)
+			tokens->storage = copy;
+		size_t bytes = source.size() + tokens->size() * sizeof(TokenView);
+		if (tokens->source.data() != copy->data())
+			bytes += tokens->source.size();
+		const size_t budget = capacity / count;
+		if (bytes > budget)
+			return tokens;
+
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto found = shard.index.find(hash);
+		if (found != shard.index.end()) {
+			shard.bytes -= found->second->bytes;
+			shard.entries.erase(found->second);
+			shard.index.erase(found);
+		}
+		while (shard.bytes + bytes > budget) {
+			auto& last = shard.entries.back();
+			shard.bytes -= last.bytes;
+			shard.index.erase(last.hash);
+			shard.entries.pop_back();
+			++eviction_count;
+		}
+		shard.entries.push_front({ hash, bytes, copy, tokens });
+		shard.index.emplace(hash, shard.entries.begin());
+		shard.bytes += bytes;
+		return tokens;
+	}
+
+	void TokenCache::clear()
+	{
+		for (size_t i = 0; i < count; ++i) {
+			std::lock_guard<std::mutex> lock(shards[i].mutex);
+			shards[i].entries.clear();
+			shards[i].index.clear();
+			shards[i].bytes = 0;
+		}
+	}
+
+	size_t TokenCache::hits() const
+	{
+		return hit_count;
+	}
+
+	size_t TokenCache::misses() const
+	{
+		return miss_count;
+	}
+
+	size_t TokenCache::evictions() const
+	{
+		return eviction_count;
+	}
+
+	size_t TokenCache::size() const
+	{
+		size_t bytes = 0;
+		for (size_t i = 0; i < count; ++i) {
+			std::lock_guard<std::mutex> lock(shards[i].mutex);
+			bytes += shards[i].bytes;
+		}
+		return bytes;
+	}
+
+	CompactTokenStream tokenize_compact(std::string_view source)
+	{
+		CompactTokenStream tokens;
+		std::string_view encoding;
+		size_t position;
+		tokens.source = decode_buffer(source, encoding, position, tokens.storage, std::pmr::get_default_resource());
+		Tokenizer tokenizer(tokens.source, encoding, position, std::pmr::get_default_resource());
+		while (auto token = tokenizer.next())
+			tokens.push_back(*token);
+		return tokens;
+	}
+
+	CompactTokenStream tokenize_compact(std::string_view source, SymbolTable& symbols)
+	{
+		CompactTokenStream tokens;
+		std::string_view encoding;
+		size_t position;
+		tokens.source = decode_buffer(source, encoding, position, tokens.storage, std::pmr::get_default_resource());
+		Tokenizer tokenizer(tokens.source, encoding, position, std::pmr::get_default_resource());
+		while (auto token = tokenizer.next()) {
+			tokens.push_back(*token);
+			uint32_t symbol = SymbolTable::none;
+			if (token->type == OP)
+				symbol = SymbolTable::symbol(token->exact);
+			if (token->type == NAME || (token->type == OP && symbol == SymbolTable::none))
+				symbol = symbols.intern(token->token);
+			tokens.symbols.push_back(symbol);
+		}
+		return tokens;
+	}
+
+	std::vector<BatchResult> tokenize_files(const std::vector<std::string>& paths, size_t threads)
+	{
+		std::vector<BatchResult> results(paths.size());
+		parallel_for(paths.size(), threads, [&](size_t i) {
+			try {
+				results[i].tokens = tokenize_file(paths[i]);
+			}
+			catch (...) {
+				results[i].error = std::current_exception();
+			}
+		});
+		return results;
+	}
+
+	std::vector<BatchResult> tokenize_buffers(const std::vector<std::string_view>& sources, size_t threads)
+	{
+		std::vector<BatchResult> results(sources.size());
+		parallel_for(sources.size(), threads, [&](size_t i) {
+			try {
+				results[i].tokens = tokenize_views(sources[i]);
+			}
+			catch (...) {
+				results[i].error = std::current_exception();
+			}
+		});
+		return results;
+	}
+
+	namespace batch
+	{
+		// Owns the memory of a TokenBatch
+		struct Storage
+		{
+			explicit Storage(size_t size)
+				: arena(size)
+			{
+
+			}
+
+			std::pmr::monotonic_buffer_resource arena;
+			// The sources which had to be transcoded to UTF-8
+			std::list<std::string> decoded;
+		};
+	}
+
+	TokenBatch tokenize_batch(const std::vector<std::string_view>& sources)
+	{
+		size_t bytes = 0;
+		for (auto source : sources)
+			bytes += source.size();
+		// Enough tokens for even dense snippets, counting the ENCODING,
+		// NEWLINE, INDENT, DEDENT and ENDMARKER tokens around each, so that
+		// the tokens and the offsets are all in the first block the arena
+		// allocates
+		size_t estimate = bytes / 2 + 6 * sources.size();
+		auto storage = std::make_shared<batch::Storage>((sources.size() + 1) * sizeof(size_t) +
+			estimate * sizeof(TokenView) + 2 * alignof(std::max_align_t));
+		TokenBatch batch{ storage, std::pmr::vector<TokenView>(&storage->arena), std::pmr::vector<size_t>(&storage->arena), {} };
+		batch.offsets.reserve(sources.size() + 1);
+		batch.tokens.reserve(estimate);
+
+		// The tokenizer's own buffers are reused for each source and only
+		// need to outlive the call
+		char buffer[4096];
+		std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+		Tokenizer tokenizer(std::string_view(), "utf-8", 0, &arena);
+		std::vector<Diagnostic> diagnostics;
+		tokenizer.report(diagnostics, Recovery::STOP);
+		std::pmr::string decoded(&arena);
+		for (size_t i = 0; i < sources.size(); ++i) {
+			batch.offsets.push_back(batch.tokens.size());
+			std::string_view encoding;
+			std::string_view text;
+			decoded.clear();
+			size_t position = codecs::decode_source(sources[i], encoding, text, decoded);
+			if (text.data() != sources[i].data())
+				text = storage->decoded.emplace_back(decoded);
+			tokenizer.restart(text, encoding, position);
+			while (auto token = tokenizer.next())
+				batch.tokens.push_back(*token);
+			if (diagnostics.size() > batch.errors.size())
+				batch.errors.emplace_back(i, std::move(diagnostics.back()));
+		}
+		batch.offsets.push_back(batch.tokens.size());
+		return batch;
+	}
+
+	TokenStream tokenize_parallel(std::string_view source, size_t threads)
+	{
+		// Below this a chunk isn't worth a thread of its own
+		const size_t min_chunk = 64 * 1024;
+
+		if (threads == 0)
+			threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+		size_t count = std::min(threads, source.size() / min_chunk);
+		if (count <= 1)
+			return tokenize_views(source);
+
+		std::shared_ptr<const void> storage;
+		std::string_view encoding;
+		size_t start;
+		source = decode_buffer(source, encoding, start, storage, std::pmr::get_default_resource());
+
+		// Cut the source into chunks just after a newline
+		std::vector<size_t> bounds = { start };
+		for (size_t i = 1; i < count; ++i) {
+			size_t newline = source.find('\n', std::max(bounds.back(), i * source.size() / count));
+			if (newline == std::string_view::npos || newline + 1 == source.size())
+				break;
+			if (newline + 1 > bounds.back())
+				bounds.push_back(newline + 1);
+		}
+		bounds.push_back(source.size());
+		count = bounds.size() - 1;
+
+		struct Chunk
+		{
+			std::unique_ptr<Tokenizer> tokenizer;
+			std::pmr::vector<TokenView> tokens;
+			std::exception_ptr error;
+			size_t lnum;
+		};
+		std::vector<Chunk> chunks(count);
+		std::vector<size_t> lines(count);
+		parallel_for(count, threads, [&](size_t i) {
+			lines[i] = std::count(source.begin() + bounds[i], source.begin() + bounds[i + 1], '\n');
+		});
+		for (size_t i = 0, lnum = 0; i < count; lnum += lines[i++])
+			chunks[i].lnum = lnum;
+
+		// Tokenizes a chunk from the state left by the previous one, or
+		// speculatively from the top level if that isn't known yet
+		auto run = [&](size_t i, const Tokenizer* previous) {
+			auto& chunk = chunks[i];
+			chunk.tokenizer.reset(new Tokenizer(source, encoding, bounds[i], std::pmr::get_default_resource()));
+			chunk.tokens.clear();
+			chunk.error = nullptr;
+			auto& tokenizer = *chunk.tokenizer;
+			tokenizer.limit = bounds[i + 1];
+			tokenizer.partial = i + 1 < count;
+			tokenizer.defer_indents = true;
+			tokenizer.lnum = chunk.lnum;
+			if (i > 0)
+				tokenizer.pending.clear();
+			if (previous)
+				tokenizer.resume(*previous);
+			try {
+				while (auto token = tokenizer.next())
+					chunk.tokens.push_back(*token);
+			}
+			catch (...) {
+				chunk.error = std::current_exception();
+			}
+		};
+		parallel_for(count, threads, [&](size_t i) { run(i, nullptr); });
+
+		// A speculative chunk is only right if the chunk before it ended at
+		// the top level, otherwise it is redone now the real state is known
+		for (size_t i = 1; i < count; ++i) {
+			const auto& previous = *chunks[i - 1].tokenizer;
+			if (!chunks[i - 1].error && !previous.at_top_level())
+				run(i, &previous);
+		}
+
+		// Finally work out the INDENT and DEDENT tokens in order
+		std::pmr::vector<TokenView> tokens;
+		size_t total = 0;
+		for (const auto& chunk : chunks)
+			total += chunk.tokens.size();
+		tokens.reserve(total);
+		std::pmr::vector<size_t> indents = { 0 };
+		for (const auto& chunk : chunks) {
+			for (const auto& token : chunk.tokens) {
+				if (token.type == INDENTATION) {
+					if (!indent(indents, tokens, token))
+						throw std::runtime_error("unindent does not match any outer indentation level");
+				}
+				else
+					tokens.push_back(token);
+			}
+			if (chunk.error)
+				std::rethrow_exception(chunk.error);
+		}
+
+		// The tokens are counted again as the chunks only saw INDENTATION
+		// markers where the INDENT and DEDENT tokens now are
+		std::shared_ptr<TokenizeStats> counters;
+		TOKENIZE_STATS_ONLY(
+			counters = std::make_shared<TokenizeStats>();
+			for (const auto& chunk : chunks)
+				*counters += *chunk.tokenizer->counters;
+			counters->tokens = {};
+			counters->token_bytes = {};
+			for (const auto& token : tokens)
+				stats::count_token(*counters, token);
+			counters->allocations += 1;
+			counters->allocated_bytes += tokens.capacity() * sizeof(TokenView);
+		)
+		return { storage, source, std::move(tokens), counters };
+	}
+
+	// Returns the offset in source of where a token starts. Tokens with no
+	// text, such as DEDENT, are placed by their line and those with no line
+	// either are at the end of the input.
+	size_t source_offset(std::string_view source, const TokenView& token)
+	{
+		auto inside = [&](std::string_view view) {
+			return !view.empty() && view.data() >= source.data() && view.data() < source.data() + source.size();
+		};
+		if (inside(token.token))
+			return token.token.data() - source.data();
+		if (inside(token.line))
+			return token.line.data() - source.data() + token.start.second;
+		return source.size();
+	}
+
+	TokenDelta retokenize(const TokenStream& previous, std::string_view source, const Edit& edit)
+	{
+		const auto& old = previous.tokens;
+		const std::ptrdiff_t offset_delta = edit.text.size() - std::ptrdiff_t(edit.end - edit.begin);
+		if (source.size() != previous.source.size() + offset_delta)
+			throw std::invalid_argument("source is not the result of the edit");
+
+		// Find the last NEWLINE which finishes before the edit, as the line
+		// after it starts at the top level. Tokens are in order of offset so
+		// the search starts from the first token after the edit begins.
+		auto after = std::partition_point(old.begin() + 1, old.end(), [&](const TokenView& token) {
+			return source_offset(previous.source, token) < edit.begin;
+		});
+		size_t first = 1;
+		size_t restart = helpers::starts_with(previous.source, codecs::codecs[1].bom) ? codecs::codecs[1].bom.size() : 0;
+		size_t lnum = 0;
+		for (auto it = after; it != old.begin() + 1; --it) {
+			const auto& token = *(it - 1);
+			if (token.type == NEWLINE && !token.token.empty() &&
+				source_offset(previous.source, token) + token.token.size() <= edit.begin) {
+				first = it - old.begin();
+				restart = source_offset(previous.source, token) + token.token.size();
+				lnum = token.start.first;
+				break;
+			}
+		}
+
+		// Besides the indents, the only state carried over a NEWLINE is
+		// needcont, which as in python is left set by a string continued
+		// with a backslash until a later continued string ends
+		std::pmr::vector<size_t> indents = { 0 };
+		size_t needcont = 0;
+		auto replay = [&](const TokenView& token) {
+			if (token.type == INDENT)
+				indents.push_back(indent_column(token.token));
+			else if (token.type == DEDENT)
+				indents.pop_back();
+			else if (token.start.first != token.end.first)
+				needcont = token.type == ERRORTOKEN;
+		};
+		for (size_t i = 1; i < first; ++i)
+			replay(old[i]);
+
+		Tokenizer tokenizer(source, "utf-8", restart, std::pmr::get_default_resource());
+		tokenizer.pending.clear();
+		tokenizer.lnum = lnum;
+		tokenizer.indents = indents;
+		tokenizer.needcont = needcont;
+
+		TokenDelta delta{ first, old.size(), {}, 0, offset_delta };
+		size_t k = first;
+		while (auto token = tokenizer.next()) {
+			delta.tokens.push_back(*token);
+			if (token->type != NEWLINE || token->token.empty())
+				continue;
+			size_t offset = token->token.data() - source.data();
+			if (offset < edit.begin + edit.text.size())
+				continue;
+
+			// The scan lines up again once the previous tokens have a NEWLINE
+			// at the same place in the unchanged text with the same state
+			size_t old_offset = offset - offset_delta;
+			while (k < old.size() && source_offset(previous.source, old[k]) < old_offset)
+				replay(old[k++]);
+			if (k < old.size() && old[k].type == NEWLINE &&
+				source_offset(previous.source, old[k]) == old_offset &&
+				indents == tokenizer.indents && needcont == tokenizer.needcont) {
+				delta.last = k + 1;
+				delta.line_delta = std::ptrdiff_t(token->start.first) - std::ptrdiff_t(old[k].start.first);
+				break;
+			}
+		}
+		return delta;
+	}
+
+	TokenStream apply_delta(const TokenStream& previous, std::string_view source, const TokenDelta& delta)
+	{
+		// Moves a view into the previous source to the same text in the new
+		// one, leaving views of string literals alone
+		auto rebase = [&](std::string_view view, std::ptrdiff_t shift) {
+			if (view.empty() || view.data() < previous.source.data() ||
+				view.data() >= previous.source.data() + previous.source.size())
+				return view;
+			return source.substr(view.data() - previous.source.data() + shift, view.size());
+		};
+
+		TokenStream tokens{ nullptr, source, {} };
+		tokens.tokens.reserve(previous.tokens.size() - (delta.last - delta.first) + delta.tokens.size());
+		for (size_t i = 0; i < delta.first; ++i) {
+			auto token = previous.tokens[i];
+			token.token = rebase(token.token, 0);
+			token.line = rebase(token.line, 0);
+			tokens.tokens.push_back(token);
+		}
+		tokens.tokens.insert(tokens.tokens.end(), delta.tokens.begin(), delta.tokens.end());
+		for (size_t i = delta.last; i < previous.tokens.size(); ++i) {
+			auto token = previous.tokens[i];
+			token.token = rebase(token.token, delta.offset_delta);
+			token.line = rebase(token.line, delta.offset_delta);
+			token.start.first += delta.line_delta;
+			token.end.first += delta.line_delta;
+			tokens.tokens.push_back(token);
+		}
+		return tokens;
+	}
+
+	std::vector<TokenInfo> tokenize(std::istream& stream)
+	{
+		std::vector<TokenInfo> tokens;
+		tokenize(stream, [&](const TokenView& token) { tokens.emplace_back(token); });
+		return tokens;
+	}
+
+	std::vector<TokenInfo> tokenize(std::string_view source)
+	{
+		auto checked = tokenize_checked(source, Recovery::STOP);
+		if (!checked)
+			helpers::raise(checked.diagnostics.front());
+		return std::move(checked.tokens);
+	}
+
+	std::vector<TokenInfo> tokenize(std::string_view source, const TokenMask& mask)
+	{
+		std::vector<TokenInfo> tokens;
+		char buffer[4096];
+		std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+		Tokenizer tokenizer(source, &arena);
+		tokenizer.set_mask(mask);
+		while (auto token = tokenizer.next())
+			tokens.emplace_back(*token);
+		return tokens;
+	}
+
+	CheckedTokens::operator bool() const
+	{
+		return diagnostics.empty();
+	}
+
+	CheckedTokens tokenize_checked(std::string_view source, Recovery recovery)
+	{
+		CheckedTokens checked;
+		// The tokenizer's own buffers only need to outlive the call
+		char buffer[4096];
+		std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+		Tokenizer tokenizer(source, &arena);
+		tokenizer.report(checked.diagnostics, recovery);
+		while (auto token = tokenizer.next())
+			checked.tokens.emplace_back(*token);
+		return checked;
 	}
 
-}
\ No newline at end of file
+}
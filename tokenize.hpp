@@ -20,15 +20,23 @@
 // which encoding was used to decode the bytes stream.
 
 
-#include <unordered_map>
-#include <unordered_set>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
+#include <memory_resource>
 #include <iostream>
 #include <exception>
 #include <algorithm>
-#include <regex>
 #include <optional>
+#include <iterator>
+#include <initializer_list>
+#include <cstdint>
+#include <type_traits>
 
 namespace tokenize_py
 {
@@ -107,6 +115,45 @@ namespace tokenize_py
 
 	std::string to_string(Token token);
 
+	// A set of token types, which holds a token if it holds either its type
+	// or its exact type
+	using TokenMask = std::bitset<N_TOKENS>;
+
+	TokenMask token_mask(std::initializer_list<Token> types);
+
+	// A token whose text refers into a buffer owned elsewhere, usually by
+	// the TokenStream it was produced in. Views are only valid as long as
+	// that buffer is alive; construct a TokenInfo to take a copy.
+	struct TokenView
+	{
+		TokenView(Token type,
+			std::string_view token,
+			std::pair<size_t, size_t> start,
+			std::pair<size_t, size_t> end,
+			std::string_view line);
+		// Takes the exact type of an operator as found by the scanner
+		TokenView(Token type,
+			std::string_view token,
+			std::pair<size_t, size_t> start,
+			std::pair<size_t, size_t> end,
+			std::string_view line,
+			Token exact);
+
+		// The type of an OP token's operator, which is found when the token
+		// is made
+		Token exact_type() const;
+		bool is_empty() const;
+
+		friend std::ostream& operator << (std::ostream& stream, const TokenView& tokview);
+
+		Token type;
+		Token exact;
+		std::string_view token;
+		std::pair<size_t, size_t> start;
+		std::pair<size_t, size_t> end;
+		std::string_view line;
+	};
+
 	struct TokenInfo
 	{
 		TokenInfo(Token type,
@@ -114,6 +161,7 @@ namespace tokenize_py
 			std::pair<size_t, size_t> start,
 			std::pair<size_t, size_t> end,
 			const std::string& line);
+		explicit TokenInfo(const TokenView& view);
 
 		Token exact_type() const;
 		bool is_empty() const;
@@ -121,26 +169,666 @@ namespace tokenize_py
 		friend std::ostream& operator << (std::ostream& stream, const TokenInfo& tokinfo);
 
 		Token type;
+		Token exact;
 		std::string token;
 		std::pair<size_t, size_t> start;
 		std::pair<size_t, size_t> end;
 		std::string line;
 	};
 
+	// Counters describing a run of the tokenizer, which are only kept when
+	// the library is built with TOKENIZE_STATS
+	struct TokenizeStats
+	{
+		// Physical lines read, the bytes in them and the longest of them
+		size_t lines = 0;
+		size_t bytes = 0;
+		size_t longest_line = 0;
+		// Tokens made of each exact type and the bytes of source they span,
+		// so operators are counted under their own types rather than OP
+		std::array<size_t, N_TOKENS> tokens = {};
+		std::array<size_t, N_TOKENS> token_bytes = {};
+		// Lines read while a string was continued from an earlier line, and
+		// the most lines which one string spanned
+		size_t string_lines = 0;
+		size_t longest_string = 0;
+		// Time spent finding the end of a continued string, measuring the
+		// indentation of a logical line and scanning the rest of a line
+		std::chrono::nanoseconds string_time = {};
+		std::chrono::nanoseconds indent_time = {};
+		std::chrono::nanoseconds scan_time = {};
+		// Allocations made from the memory resource while tokenizing,
+		// including the token array of a TokenStream
+		size_t allocations = 0;
+		size_t allocated_bytes = 0;
+
+		// Adds the counts of another run, keeping the larger of the maxima
+		TokenizeStats& operator += (const TokenizeStats& other);
+
+		friend std::ostream& operator << (std::ostream& stream, const TokenizeStats& stats);
+	};
+
+	// The tokens of a source file along with the buffer which their views
+	// refer into. When the buffer isn't owned by the caller it is kept alive
+	// by storage, which is shared so that a TokenStream can be copied and
+	// moved without invalidating the views.
+	struct TokenStream
+	{
+		using const_iterator = std::pmr::vector<TokenView>::const_iterator;
+
+		const_iterator begin() const;
+		const_iterator end() const;
+		size_t size() const;
+		const TokenView& operator [] (size_t i) const;
+
+		std::shared_ptr<const void> storage;
+		std::string_view source;
+		std::pmr::vector<TokenView> tokens;
+		// The counters of the run which made the tokens, which is null unless
+		// the library is built with TOKENIZE_STATS
+		std::shared_ptr<const TokenizeStats> stats;
+	};
+
+	// The same tokens as a TokenStream stored as separate arrays of each
+	// field, which takes a fraction of the memory and lets a pass over one
+	// field, such as counting the tokens of a type, run over contiguous data.
+	// Offsets are 32 bits so the source must be under 4GiB.
+	class CompactTokenStream
+	{
+	public:
+		struct Position
+		{
+			uint32_t line;
+			uint32_t col;
+		};
+
+		// Rebuilds each TokenView as it is dereferenced
+		class const_iterator
+		{
+		public:
+			using iterator_category = std::random_access_iterator_tag;
+			using value_type = TokenView;
+			using difference_type = std::ptrdiff_t;
+			using pointer = void;
+			using reference = TokenView;
+
+			const_iterator(const CompactTokenStream* tokens, size_t i);
+
+			TokenView operator * () const;
+			TokenView operator [] (difference_type n) const;
+			const_iterator& operator ++ ();
+			const_iterator operator ++ (int);
+			const_iterator& operator += (difference_type n);
+			const_iterator operator + (difference_type n) const;
+			difference_type operator - (const const_iterator& other) const;
+			bool operator == (const const_iterator& other) const;
+			bool operator != (const const_iterator& other) const;
+			bool operator < (const const_iterator& other) const;
+
+		private:
+			const CompactTokenStream* tokens;
+			size_t i;
+		};
+
+		CompactTokenStream();
+		explicit CompactTokenStream(const TokenStream& tokens);
+
+		void push_back(const TokenView& token);
+		void reserve(size_t n);
+
+		const_iterator begin() const;
+		const_iterator end() const;
+		size_t size() const;
+		TokenView operator [] (size_t i) const;
+
+		std::shared_ptr<const void> storage;
+		std::string_view source;
+		std::string encoding;
+
+		std::vector<uint8_t> types;
+		std::vector<uint32_t> offsets;
+		std::vector<uint32_t> lengths;
+		// Index into line_spans of the line each token is on, which is
+		// shared by all the tokens on one line
+		std::vector<uint32_t> lines;
+		std::vector<Position> starts;
+		std::vector<Position> ends;
+		std::vector<std::pair<uint32_t, uint32_t>> line_spans;
+		// The symbol of each NAME and OP token, and SymbolTable::none for
+		// the others, when tokenized with a SymbolTable. Empty otherwise.
+		std::vector<uint32_t> symbols;
+	};
+
+	// Interns the text of names and operators as 32 bit symbols, so that
+	// comparing two of them is comparing integers. One table can be shared
+	// by threads tokenizing at the same time: it is split into shards by the
+	// hash of the text, each with its own lock, while the text of a symbol
+	// is found without locking. The keywords and operators are recognised
+	// without a lookup and have the same symbols in every table.
+	class SymbolTable
+	{
+	public:
+		static constexpr uint32_t none = ~uint32_t(0);
+		// Symbols below this are the keywords in the order of keyword.kwlist,
+		// which are followed by the operators in the order of their types
+		static constexpr uint32_t keywords = 35;
+
+		explicit SymbolTable(size_t shards = 16);
+		SymbolTable(const SymbolTable&) = delete;
+		SymbolTable& operator = (const SymbolTable&) = delete;
+		~SymbolTable();
+
+		uint32_t intern(std::string_view text);
+		// Returns the symbol of text, or none if it hasn't been interned
+		uint32_t find(std::string_view text) const;
+		// The text of a symbol, which lives as long as the table
+		std::string_view name(uint32_t symbol) const;
+		size_t size() const;
+
+		static bool is_keyword(uint32_t symbol);
+		// The symbol of an operator from its exact type, or none if the type
+		// isn't an operator
+		static uint32_t symbol(Token exact);
+
+	private:
+		struct Shard;
+
+		// Symbols are numbered in order, with the text of each stored in
+		// segments which double in size and are never moved once allocated
+		static constexpr size_t segments = 26;
+
+		size_t count;
+		std::unique_ptr<Shard[]> shards;
+		std::atomic<uint32_t> next;
+		std::array<std::atomic<std::string_view*>, segments> names;
+	};
+
+	// Tokens saved by write_tokens, which are decoded from a file mapped into
+	// memory as they are iterated over rather than being read up front. The
+	// views refer into the source which the tokens were made from.
+	class TokenFile
+	{
+	public:
+		// Decodes each token as it is reached
+		class const_iterator
+		{
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = TokenView;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const TokenView*;
+			using reference = const TokenView&;
+
+			const_iterator(const TokenFile* tokens, size_t i);
+
+			reference operator * () const;
+			pointer operator -> () const;
+			const_iterator& operator ++ ();
+			const_iterator operator ++ (int);
+			bool operator == (const const_iterator& other) const;
+			bool operator != (const const_iterator& other) const;
+
+		private:
+			void decode();
+
+			const TokenFile* tokens;
+			size_t i;
+			const char* record;
+			size_t row;
+			size_t token_end;
+			size_t line_begin;
+			std::optional<TokenView> current;
+		};
+
+		// Maps a file written by write_tokens for source, which is the
+		// TokenStream::source that was written. Throws std::runtime_error
+		// if the file was written for another source or by another version
+		// of the tokenizer.
+		TokenFile(const std::string& path, std::string_view source);
+
+		const_iterator begin() const;
+		const_iterator end() const;
+		size_t size() const;
+
+		std::shared_ptr<const void> storage;
+		std::string_view source;
+		std::string_view encoding;
+
+	private:
+		std::shared_ptr<const void> file;
+		std::string_view records;
+		size_t count;
+	};
+
+	// Keeps the tokens of recently tokenized sources in memory, so that
+	// tokenizing the same text again hands back the tokens already made. The
+	// cache is split into shards by the hash of a source, each with its own
+	// lock and least recently used order, so that threads looking up
+	// different sources rarely wait for each other.
+	class TokenCache
+	{
+	public:
+		// Keeps up to capacity bytes of sources and their tokens, split
+		// evenly between the shards, evicting the least recently used
+		explicit TokenCache(size_t capacity, size_t shards = 16);
+		TokenCache(const TokenCache&) = delete;
+		TokenCache& operator = (const TokenCache&) = delete;
+		~TokenCache();
+
+		// Returns the tokens of a buffer owned by the caller, tokenizing it
+		// unless it is cached. The tokens refer into a copy of the source
+		// which they keep alive, and stay valid after they are evicted.
+		std::shared_ptr<const TokenStream> tokenize(std::string_view source);
+		void clear();
+
+		size_t hits() const;
+		size_t misses() const;
+		size_t evictions() const;
+		// The bytes held by the cache at the moment
+		size_t size() const;
+
+	private:
+		struct Shard;
+
+		size_t capacity;
+		size_t count;
+		std::unique_ptr<Shard[]> shards;
+		std::atomic<size_t> hit_count;
+		std::atomic<size_t> miss_count;
+		std::atomic<size_t> eviction_count;
+	};
+
+	// A change to a source replacing the bytes [begin, end) with text
+	struct Edit
+	{
+		size_t begin;
+		size_t end;
+		std::string_view text;
+	};
+
+	// The tokens which changed after an edit. Tokens [first, last) of the
+	// previous stream are replaced by tokens, which refer into the edited
+	// source. Every previous token from last onwards is unchanged except
+	// that it is line_delta lines and offset_delta bytes further on.
+	struct TokenDelta
+	{
+		size_t first;
+		size_t last;
+		std::pmr::vector<TokenView> tokens;
+		std::ptrdiff_t line_delta;
+		std::ptrdiff_t offset_delta;
+	};
+
+	// The result of tokenizing one source of a batch. If tokenizing it
+	// failed, error holds the exception which was thrown and tokens is empty.
+	struct BatchResult
+	{
+		TokenStream tokens;
+		std::exception_ptr error;
+	};
+
 	class TokenError : public std::runtime_error
 	{
 	public:
 		TokenError(const std::string& msg, const std::pair<size_t, size_t>& pos);
 	};
 
+	// Bounds on the input a tokenizer accepts, so that the memory it uses
+	// stays bounded however large or malicious the input is
+	struct TokenizeLimits
+	{
+		// Bytes in one physical line, including its terminator
+		size_t max_line = SIZE_MAX;
+		// Bytes in a string literal continued over more than one line
+		size_t max_string = SIZE_MAX;
+		// Tokens produced in all
+		size_t max_tokens = SIZE_MAX;
+		// Brackets open at once
+		size_t max_parens = SIZE_MAX;
+		// Levels of indentation
+		size_t max_indents = SIZE_MAX;
+	};
+
+	// Thrown once the input passes one of the TokenizeLimits
+	class LimitError : public TokenError
+	{
+	public:
+		enum Limit { LINE, STRING, TOKENS, PARENS, INDENTS };
+
+		LimitError(Limit limit, const std::string& msg, const std::pair<size_t, size_t>& pos);
+
+		Limit limit;
+	};
+
+	// An error in a source which was reported rather than thrown
+	struct Diagnostic
+	{
+		enum Kind { EOF_IN_STRING, EOF_IN_STATEMENT, BAD_DEDENT };
+
+		Kind kind;
+		std::string message;
+		std::pair<size_t, size_t> position;
+		// The state of the tokenizer when the error was found
+		std::ptrdiff_t parenlev;
+		size_t indents;
+		bool in_string;
+		// Whether tokenizing carried on past the error
+		bool recovered;
+	};
+
+	// What tokenizing does after an error in the source
+	enum class Recovery
+	{
+		// Stop at the first error, as tokenize() does
+		STOP,
+		// Carry on: an unterminated string becomes an ERRORTOKEN, an
+		// unfinished statement is ended, and a line whose indentation
+		// matches no outer level carries on the block it is inside
+		CONTINUE,
+	};
+
+	// The tokens of many small sources owned by the caller, which are all
+	// kept in one array. The tokens of source i are tokens[offsets[i],
+	// offsets[i + 1]), so offsets has one more entry than there are sources.
+	// A source with an error in it has the tokens up to the error, and the
+	// error in errors along with the index of the source.
+	struct TokenBatch
+	{
+		std::shared_ptr<const void> storage;
+		std::pmr::vector<TokenView> tokens;
+		std::pmr::vector<size_t> offsets;
+		std::vector<std::pair<size_t, Diagnostic>> errors;
+	};
+
 	class StopTokenizing : public std::exception {};
 
+	// Produces the tokens of a source one at a time. The state of the
+	// tokenizer is kept between lines in the same way as the python
+	// generator, so only as much input as is needed for the next token is
+	// read and a consumer can stop at any point.
+	class Tokenizer
+	{
+	public:
+		class iterator
+		{
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using value_type = TokenView;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const TokenView*;
+			using reference = const TokenView&;
+
+			iterator();
+			explicit iterator(Tokenizer& tokenizer);
+
+			reference operator * () const;
+			pointer operator -> () const;
+			iterator& operator ++ ();
+			bool operator == (const iterator& other) const;
+			bool operator != (const iterator& other) const;
+
+		private:
+			Tokenizer* tokenizer;
+			std::optional<TokenView> current;
+		};
+
+		// Reads lines from the stream as they are needed. The views returned
+		// are only valid until the following call to next().
+		explicit Tokenizer(std::istream& stream,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+		// Tokenizes a buffer owned by the caller. The views returned are
+		// valid for as long as the buffer is, or the tokenizer if the source
+		// had to be transcoded to UTF-8.
+		explicit Tokenizer(std::string_view source,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+		// Tokenizes input which is pushed to it in chunks, keeping no more
+		// of it than the line being tokenized and any string continued from
+		// earlier lines. next() returns std::nullopt when it needs more input
+		// until close() is called. The views returned are only valid until
+		// the following call to next().
+		explicit Tokenizer(const TokenizeLimits& limits,
+			std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+		// Adds the next chunk of the input of a tokenizer made to be pushed to
+		void push(std::string_view chunk);
+		// Marks the end of the pushed input
+		void close();
+		// Whether the last call to next() returned std::nullopt because it is
+		// waiting for more input to be pushed
+		bool needs_input() const;
+
+		// Throws a LimitError from next() once the input passes limits
+		void set_limits(const TokenizeLimits& limits);
+		// Only returns the tokens in mask from next(). The others are still
+		// scanned so that positions and indentation are tracked, but are
+		// dropped before they are handed out.
+		void set_mask(const TokenMask& mask);
+		// Adds errors in the source to diagnostics rather than throwing them.
+		// With Recovery::STOP no more tokens are produced after the first.
+		void report(std::vector<Diagnostic>& diagnostics, Recovery recovery);
+
+		// Returns the next token, or std::nullopt once the ENDMARKER has
+		// been returned.
+		std::optional<TokenView> next();
+
+		iterator begin();
+		iterator end();
+
+		// The counters of the tokens returned so far, which is null unless
+		// the library is built with TOKENIZE_STATS
+		const TokenizeStats* stats() const;
+
+	private:
+		// Tokenizes text which is already UTF-8 from the given offset
+		Tokenizer(std::string_view text, std::string_view encoding, size_t position,
+			std::pmr::memory_resource* resource);
+
+		bool read_line(size_t& offset, std::string_view& line);
+		bool read_limited();
+		bool take_pushed();
+		bool detect_pushed();
+		bool tokenize_line(size_t offset, std::string_view line);
+		void finish();
+		bool at_top_level() const;
+		void drop_masked();
+		bool fail(Diagnostic::Kind kind, const char* message, const std::pair<size_t, size_t>& position);
+		void resume(const Tokenizer& previous);
+		void restart(std::string_view text, std::string_view encoding, size_t position);
+
+		friend TokenStream tokenize_views(std::string_view source, std::pmr::memory_resource* resource);
+		friend CompactTokenStream tokenize_compact(std::string_view source);
+		friend CompactTokenStream tokenize_compact(std::string_view source, SymbolTable& symbols);
+		friend TokenBatch tokenize_batch(const std::vector<std::string_view>& sources);
+		friend TokenStream tokenize_parallel(std::string_view source, size_t threads);
+		friend TokenFile tokenize_cached(std::string_view source, const std::string& directory);
+		friend TokenDelta retokenize(const TokenStream& previous, std::string_view source, const Edit& edit);
+
+		// Declared first so that allocations made by the members below are
+		// counted in it
+		std::shared_ptr<TokenizeStats> counters;
+		std::istream* stream;
+		std::string_view encoding;
+		std::vector<std::string> lookahead;
+		std::pmr::string input;
+		std::pmr::string buffer;
+		std::string_view text;
+		size_t position;
+		size_t limit;
+		bool partial;
+		bool defer_indents;
+		TokenizeLimits limits;
+		size_t emitted;
+		TokenMask mask;
+		bool masked;
+
+		// The input pushed so far which hasn't been read yet starts at
+		// consumed
+		std::pmr::string pushed;
+		size_t consumed;
+		bool pushing;
+		bool detected;
+		bool closed;
+		bool waiting;
+		std::vector<Diagnostic>* diagnostics;
+		Recovery recovery;
+
+		std::pmr::vector<TokenView> pending;
+		size_t index;
+		bool done;
+
+		size_t lnum;
+		std::ptrdiff_t parenlev;
+		size_t continued;
+		size_t contstr;
+		size_t needcont;
+		size_t contline;
+		std::pmr::vector<size_t> indents;
+		// The closing quote of a string continued over lines
+		char endquote;
+		bool endtriple;
+		std::pair<size_t, size_t> strstart;
+		std::string_view last_line;
+	};
+
 	// Produces a sequence of TokenInfo objects from an input stream. 
 	std::vector<TokenInfo> tokenize(std::istream& stream);
-	// FIXME: Always returns 'utf-8'
+	// Produces a sequence of TokenInfo objects from a buffer
+	std::vector<TokenInfo> tokenize(std::string_view source);
+	// Produces TokenInfo objects for only the tokens of a buffer in mask,
+	// without copying the text of the others
+	std::vector<TokenInfo> tokenize(std::string_view source, const TokenMask& mask);
+
+	// The tokens of a source as far as tokenizing got, and the errors
+	// found in it
+	struct CheckedTokens
+	{
+		std::vector<TokenInfo> tokens;
+		std::vector<Diagnostic> diagnostics;
+
+		// Whether the source had no errors
+		explicit operator bool() const;
+	};
+
+	// Tokenizes a buffer without throwing for errors in the source, which
+	// are returned as diagnostics. Only a source which can't be decoded
+	// still throws.
+	CheckedTokens tokenize_checked(std::string_view source, Recovery recovery = Recovery::CONTINUE);
+
+	namespace detail
+	{
+		// Only takes part in overloading for sinks which accept a TokenView
+		template<class Sink>
+		using if_sink = std::enable_if_t<std::is_invocable_v<Sink&, const TokenView&>>;
+
+		// Drives a tokenizer into a sink, stopping if the sink returns false
+		template<class Sink>
+		bool visit(Tokenizer& tokenizer, Sink& sink)
+		{
+			while (auto token = tokenizer.next()) {
+				if constexpr (std::is_void_v<std::invoke_result_t<Sink&, const TokenView&>>)
+					sink(*token);
+				else if (!sink(*token))
+					return false;
+			}
+			return true;
+		}
+	}
+
+	// Passes each token of a buffer owned by the caller to sink as a const
+	// TokenView& as soon as it is found, without keeping any of them. If the
+	// sink returns a bool, returning false stops tokenizing. Returns whether
+	// every token was visited.
+	template<class Sink, class = detail::if_sink<Sink>>
+	bool tokenize(std::string_view source, Sink&& sink)
+	{
+		// The tokenizer's own buffers only need to outlive the call
+		char buffer[4096];
+		std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+		Tokenizer tokenizer(source, &arena);
+		return detail::visit(tokenizer, sink);
+	}
+
+	// Passes each token of an input stream to sink in the same way, reading
+	// only as much of the stream as is needed. The views are only valid
+	// during the call to sink.
+	template<class Sink, class = detail::if_sink<Sink>>
+	bool tokenize(std::istream& stream, Sink&& sink)
+	{
+		Tokenizer tokenizer(stream);
+		return detail::visit(tokenizer, sink);
+	}
+
+	// Produces a sequence of TokenView objects from an input stream without
+	// copying the text of each token.
+	//
+	// The functions returning a TokenStream allocate the tokens, and the
+	// source read from a stream, from the given memory resource. An arena
+	// such as std::pmr::monotonic_buffer_resource frees it all at once, but
+	// must then outlive the TokenStream.
+	TokenStream tokenize_views(std::istream& stream,
+		std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+	// Produces a sequence of TokenView objects referring into a buffer owned
+	// by the caller.
+	TokenStream tokenize_views(std::string_view source,
+		std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+	// Maps a file into memory and produces a sequence of TokenView objects
+	// referring into it.
+	TokenStream tokenize_file(const std::string& path,
+		std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+	// Tokenizes only as much of a source as is needed to update the tokens
+	// of it before an edit. Scanning starts at the last line before the edit
+	// which began at the top level, and stops at the first NEWLINE after the
+	// edit from which the previous tokens are known to be unchanged. The
+	// source is the buffer after the edit.
+	TokenDelta retokenize(const TokenStream& previous, std::string_view source, const Edit& edit);
+	// Applies the delta from retokenize to the stream it was made from,
+	// giving the tokens of the edited source.
+	TokenStream apply_delta(const TokenStream& previous, std::string_view source, const TokenDelta& delta);
+	// Produces the tokens of a buffer owned by the caller straight into a
+	// CompactTokenStream.
+	CompactTokenStream tokenize_compact(std::string_view source);
+	// Produces the tokens of a buffer owned by the caller into a
+	// CompactTokenStream, interning the text of each name and operator
+	CompactTokenStream tokenize_compact(std::string_view source, SymbolTable& symbols);
+	// Writes tokens in the format read by TokenFile. Their text is kept as
+	// offsets into the source along with a hash of it, so the source must be
+	// at hand again to read them.
+	void write_tokens(const TokenStream& tokens, std::ostream& out);
+	// Reads the tokens of a buffer owned by the caller from a file in the
+	// directory named by a hash of its contents, first tokenizing it and
+	// writing the file if there isn't one. The directory must exist.
+	TokenFile tokenize_cached(std::string_view source, const std::string& directory);
+	// Tokenizes each file in parallel over the given number of threads, or
+	// one per hardware thread if it is zero. The results are in the same
+	// order as the paths.
+	std::vector<BatchResult> tokenize_files(const std::vector<std::string>& paths, size_t threads = 0);
+	// Tokenizes each buffer, which is owned by the caller, in parallel over
+	// the given number of threads, or one per hardware thread if it is zero.
+	std::vector<BatchResult> tokenize_buffers(const std::vector<std::string_view>& sources, size_t threads = 0);
+	// Tokenizes many small buffers, which are owned by the caller, one after
+	// another on this thread. One tokenizer is reused for them all and the
+	// tokens go into a single array, so the cost of each source is little
+	// more than that of its tokens. Errors in a source stop it as
+	// Recovery::STOP would, but not the batch.
+	TokenBatch tokenize_batch(const std::vector<std::string_view>& sources);
+	// Tokenizes a single large buffer owned by the caller by splitting it
+	// into chunks of lines which are tokenized in parallel, giving the same
+	// result as tokenize_views().
+	TokenStream tokenize_parallel(std::string_view source, size_t threads = 0);
+	// Works out the encoding of a source from a BOM or a PEP 263 coding
+	// cookie in its first two lines, reading no more of the stream than
+	// that. Returns the encoding along with the lines which were read.
 	std::pair<std::string, std::vector<std::string>> detect_encoding(std::istream& stream);
-	// FIXME: Always returns 'utf-8'
+	// Works out the encoding of a buffer in the same way, looking at no more
+	// than its first two lines. Returns copies of the lines looked at.
+	std::pair<std::string, std::vector<std::string>> detect_encoding(std::string_view source);
+	// Normalises the name of an encoding in the same way as python
 	std::string get_normal_name(const std::string orig_enc);
+	// Transcodes source to UTF-8 from utf-8, iso-8859-1, cp1252 or utf-16
+	// (under any of their usual names), skipping any BOM
+	std::string decode(std::string_view source, const std::string& encoding);
 	// Transform tokens back into Python source code
 	std::string untokenize(const std::vector<TokenInfo>& iterable);
+	// Transform tokens back into Python source code, writing it to a stream
+	void untokenize(const std::vector<TokenInfo>& iterable, std::ostream& out);
 } // namespace tokenize
\ No newline at end of file
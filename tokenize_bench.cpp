@@ -0,0 +1,466 @@
+// Throughput benchmarks for the tokenizer
+//
+// Each benchmark reports bytes/s and tokens/s over one of a set of
+// generated sources, along with the number of heap allocations made per
+// token, so that regressions in the scanner show up in any of them.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "tokenize.hpp"
+
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace corpus
+{
+	// Ordinary library code: classes, functions, docstrings, comments,
+	// decorators and a mix of literals
+	std::string stdlib_like()
+	{
+		const std::string module = R"py(# A module of the sort found in the standard library
+"""Summary line.
+
+Longer description of the module which goes on
+for a few lines.
+"""
+import os
+import sys
+from collections import namedtuple as _nt
+
+__all__ = ["Thing", "make_thing", "MAX_SIZE"]
+
+MAX_SIZE = 0x7fff_ffff
+_DEFAULT = 1.5e-3
+
+
+class Thing(object):
+    """A thing."""
+
+    __slots__ = ('name', 'size', '_cache')
+
+    def __init__(self, name, size=10, *args, **kwargs):
+        self.name = name
+        self.size = size
+        self._cache = {}
+
+    @property
+    def area(self):
+        return self.size ** 2 if self.size >= 0 else -1
+
+    def __repr__(self):
+        return f"Thing({self.name!r}, size={self.size})"
+
+    async def fetch(self, key):
+        value = await self._load(key)
+        self._cache[key] = value
+        return value
+
+
+def make_thing(name, *, size=None):
+    # Fall back to the default
+    if size is None:
+        size = int(_DEFAULT * 1000) // 3
+    elif not isinstance(size, int):
+        raise TypeError("size must be an int, not %s" % type(size).__name__)
+    result = [Thing(n, s) for n, s in zip(name.split(','), range(size))
+              if n and s % 2 == 0]
+    return result[0] if len(result) == 1 else result
+
+
+def _helper(a, b, c):
+    x = (a + b) * c - (a << 2) | (b >> 1) & ~c
+    y = {'a': a, 'b': b, "c": c, **os.environ}
+    z = lambda q: q @ x if hasattr(q, '__matmul__') else q
+    return x, y, z
+
+)py";
+		std::string source;
+		while (source.size() < 256 * 1024)
+			source += module;
+		return source;
+	}
+
+	// Blocks nested as far as the indentation will go, holding brackets
+	// nested just as deeply
+	std::string nested()
+	{
+		std::string source;
+		while (source.size() < 256 * 1024) {
+			std::string indent;
+			for (int depth = 0; depth < 40; ++depth) {
+				source += indent + "if x" + std::to_string(depth) + ":\n";
+				indent += "    ";
+			}
+			source += indent + "y = " + std::string(40, '(') + "[{1: (2, [3])}]" + std::string(40, ')') + "\n";
+			source += "z = 0\n";
+		}
+		return source;
+	}
+
+	// Triple quoted strings of many lines along with very long single line
+	// string literals
+	std::string huge_strings()
+	{
+		std::string source = "data = \"\"\"\n";
+		for (int i = 0; i < 4000; ++i)
+			source += "aGVsbG8gd29ybGQgdGhpcyBpcyBiYXNlNjQgZGF0YSBpbiBhIGRvY3N0cmluZw== \\\" ' \"\" ''\n";
+		source += "\"\"\"\n";
+		for (int i = 0; i < 100; ++i)
+			source += "blob = '" + std::string(1000, 'x') + "\\'" + std::string(1000, 'y') + "'\n";
+		return source;
+	}
+
+	// Generated code with very long lines
+	std::string long_lines()
+	{
+		std::string source;
+		for (int i = 0; i < 64; ++i) {
+			source += "table_" + std::to_string(i) + " = [";
+			for (int j = 0; j < 500; ++j)
+				source += std::to_string(i * j) + ", name_" + std::to_string(j) + ", ";
+			source += "None]\n";
+		}
+		return source;
+	}
+
+	// Many tiny snippets, as from a review tool
+	std::vector<std::string> small_files()
+	{
+		std::vector<std::string> files;
+		for (int i = 0; i < 1000; ++i) {
+			files.push_back("def f" + std::to_string(i) + "(a, b):\n"
+				"    return a + b * " + std::to_string(i) + "\n");
+		}
+		return files;
+	}
+
+	const std::string& get(int which)
+	{
+		static const std::string sources[] = { stdlib_like(), nested(), huge_strings(), long_lines() };
+		return sources[which];
+	}
+
+	const char* const names[] = { "stdlib_like", "nested", "huge_strings", "long_lines" };
+}
+
+static void set_counters(benchmark::State& state, size_t bytes, size_t tokens, size_t allocs)
+{
+	state.SetBytesProcessed(int64_t(bytes) * state.iterations());
+	state.counters["tokens/s"] = benchmark::Counter(double(tokens) * state.iterations(), benchmark::Counter::kIsRate);
+	state.counters["allocs/token"] = double(allocs) / (double(tokens) * state.iterations());
+}
+
+static void BM_tokenize(benchmark::State& state)
+{
+	const auto& source = corpus::get(int(state.range(0)));
+	state.SetLabel(corpus::names[state.range(0)]);
+	size_t tokens = 0;
+	size_t before = allocations;
+	for (auto _ : state) {
+		auto result = tokenize_py::tokenize(source);
+		tokens = result.size();
+		benchmark::DoNotOptimize(result.data());
+	}
+	set_counters(state, source.size(), tokens, allocations - before);
+}
+BENCHMARK(BM_tokenize)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+// Only the comments, as a license scanner would want
+static void BM_tokenize_masked(benchmark::State& state)
+{
+	const auto& source = corpus::get(int(state.range(0)));
+	state.SetLabel(corpus::names[state.range(0)]);
+	const auto mask = tokenize_py::token_mask({ tokenize_py::COMMENT });
+	size_t tokens = 0;
+	size_t before = allocations;
+	for (auto _ : state) {
+		auto result = tokenize_py::tokenize(source, mask);
+		tokens = result.size();
+		benchmark::DoNotOptimize(result.data());
+	}
+	set_counters(state, source.size(), tokens, allocations - before);
+}
+BENCHMARK(BM_tokenize_masked)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+static void BM_tokenize_views(benchmark::State& state)
+{
+	const auto& source = corpus::get(int(state.range(0)));
+	state.SetLabel(corpus::names[state.range(0)]);
+	size_t tokens = 0;
+	size_t before = allocations;
+	for (auto _ : state) {
+		auto result = tokenize_py::tokenize_views(source);
+		tokens = result.size();
+		benchmark::DoNotOptimize(result.tokens.data());
+	}
+	set_counters(state, source.size(), tokens, allocations - before);
+}
+BENCHMARK(BM_tokenize_views)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+// A consumer which only counts the NAME tokens, so never keeps any
+static void BM_tokenize_sink(benchmark::State& state)
+{
+	const auto& source = corpus::get(int(state.range(0)));
+	state.SetLabel(corpus::names[state.range(0)]);
+	size_t tokens = 0;
+	size_t before = allocations;
+	for (auto _ : state) {
+		size_t names = 0;
+		tokens = 0;
+		tokenize_py::tokenize(source, [&](const tokenize_py::TokenView& token) {
+			names += token.type == tokenize_py::NAME;
+			++tokens;
+		});
+		benchmark::DoNotOptimize(names);
+	}
+	set_counters(state, source.size(), tokens, allocations - before);
+}
+BENCHMARK(BM_tokenize_sink)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+// Interning into a table which already holds every name, as it would for
+// an indexer going over the same modules again
+static void BM_tokenize_interned(benchmark::State& state)
+{
+	const auto& source = corpus::get(int(state.range(0)));
+	state.SetLabel(corpus::names[state.range(0)]);
+	tokenize_py::SymbolTable symbols;
+	size_t tokens = tokenize_py::tokenize_compact(source, symbols).size();
+	size_t before = allocations;
+	for (auto _ : state) {
+		auto result = tokenize_py::tokenize_compact(source, symbols);
+		benchmark::DoNotOptimize(result.symbols.data());
+	}
+	set_counters(state, source.size(), tokens, allocations - before);
+}
+BENCHMARK(BM_tokenize_interned)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+static void BM_tokenize_stream(benchmark::State& state)
+{
+	const auto& source = corpus::get(int(state.range(0)));
+	state.SetLabel(corpus::names[state.range(0)]);
+	size_t tokens = 0;
+	size_t before = allocations;
+	for (auto _ : state) {
+		state.PauseTiming();
+		std::istringstream stream(source);
+		state.ResumeTiming();
+		tokens = 0;
+		tokenize_py::Tokenizer tokenizer(stream);
+		while (auto token = tokenizer.next())
+			++tokens;
+	}
+	set_counters(state, source.size(), tokens, allocations - before);
+}
+BENCHMARK(BM_tokenize_stream)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+// Pushes the source in 4K chunks, as a socket or pipe would deliver it
+static void BM_tokenize_push(benchmark::State& state)
+{
+	const auto& source = corpus::get(int(state.range(0)));
+	state.SetLabel(corpus::names[state.range(0)]);
+	tokenize_py::TokenizeLimits limits;
+	limits.max_line = 1 << 16;
+	size_t tokens = 0;
+	size_t before = allocations;
+	for (auto _ : state) {
+		tokens = 0;
+		tokenize_py::Tokenizer tokenizer(limits);
+		size_t position = 0;
+		for (;;) {
+			if (auto token = tokenizer.next())
+				++tokens;
+			else if (!tokenizer.needs_input())
+				break;
+			else if (position < source.size()) {
+				tokenizer.push(std::string_view(source).substr(position, 4096));
+				position += 4096;
+			}
+			else
+				tokenizer.close();
+		}
+	}
+	set_counters(state, source.size(), tokens, allocations - before);
+}
+BENCHMARK(BM_tokenize_push)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+static void BM_tokenize_small_files(benchmark::State& state)
+{
+	static const auto files = corpus::small_files();
+	size_t bytes = 0;
+	for (const auto& file : files)
+		bytes += file.size();
+	size_t tokens = 0;
+	size_t before = allocations;
+	for (auto _ : state) {
+		tokens = 0;
+		for (const auto& file : files)
+			tokens += tokenize_py::tokenize(file).size();
+	}
+	set_counters(state, bytes, tokens, allocations - before);
+}
+BENCHMARK(BM_tokenize_small_files)->Unit(benchmark::kMillisecond);
+
+// The same files tokenized as one batch
+static void BM_tokenize_batch(benchmark::State& state)
+{
+	static const auto files = corpus::small_files();
+	const std::vector<std::string_view> sources(files.begin(), files.end());
+	size_t bytes = 0;
+	for (auto source : sources)
+		bytes += source.size();
+	size_t tokens = 0;
+	size_t before = allocations;
+	for (auto _ : state) {
+		auto batch = tokenize_py::tokenize_batch(sources);
+		tokens = batch.tokens.size();
+		benchmark::DoNotOptimize(batch.tokens.data());
+	}
+	set_counters(state, bytes, tokens, allocations - before);
+}
+BENCHMARK(BM_tokenize_batch)->Unit(benchmark::kMillisecond);
+
+// Snippets of which a third are cut off inside brackets, as partial cells
+// and diffs often are, which are tokenized by catching exceptions (0) or by
+// reporting diagnostics (1)
+static void BM_tokenize_snippets(benchmark::State& state)
+{
+	static const auto files = corpus::small_files();
+	std::vector<std::string_view> snippets;
+	size_t bytes = 0;
+	for (size_t i = 0; i < files.size(); ++i) {
+		std::string_view file = files[i];
+		snippets.push_back(i % 3 ? file : file.substr(0, file.find(',') + 1));
+		bytes += snippets.back().size();
+	}
+	size_t tokens = 0;
+	size_t errors = 0;
+	size_t before = allocations;
+	for (auto _ : state) {
+		tokens = 0;
+		errors = 0;
+		for (auto snippet : snippets) {
+			if (state.range(0) == 0) {
+				try {
+					tokens += tokenize_py::tokenize(snippet).size();
+				}
+				catch (const std::exception&) {
+					++errors;
+				}
+			}
+			else {
+				auto checked = tokenize_py::tokenize_checked(snippet, tokenize_py::Recovery::STOP);
+				tokens += checked.tokens.size();
+				errors += !checked;
+			}
+		}
+	}
+	set_counters(state, bytes, tokens, allocations - before);
+	state.counters["errors"] = double(errors);
+}
+BENCHMARK(BM_tokenize_snippets)->DenseRange(0, 1)->Unit(benchmark::kMillisecond);
+
+static void BM_untokenize(benchmark::State& state)
+{
+	const auto& source = corpus::get(int(state.range(0)));
+	state.SetLabel(corpus::names[state.range(0)]);
+	const auto tokens = tokenize_py::tokenize(source);
+	size_t before = allocations;
+	for (auto _ : state) {
+		auto result = tokenize_py::untokenize(tokens);
+		benchmark::DoNotOptimize(result.data());
+	}
+	set_counters(state, source.size(), tokens.size(), allocations - before);
+}
+BENCHMARK(BM_untokenize)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+static void BM_exact_type(benchmark::State& state)
+{
+	const auto tokens = tokenize_py::tokenize(corpus::get(0));
+	size_t before = allocations;
+	for (auto _ : state) {
+		for (const auto& token : tokens)
+			benchmark::DoNotOptimize(token.exact_type());
+	}
+	state.counters["tokens/s"] = benchmark::Counter(double(tokens.size()) * state.iterations(), benchmark::Counter::kIsRate);
+	state.counters["allocs/token"] = double(allocations - before) / (double(tokens.size()) * state.iterations());
+}
+BENCHMARK(BM_exact_type);
+
+static void BM_detect_encoding(benchmark::State& state)
+{
+	const auto& source = corpus::get(0);
+	for (auto _ : state) {
+		state.PauseTiming();
+		std::istringstream stream(source);
+		state.ResumeTiming();
+		auto result = tokenize_py::detect_encoding(stream);
+		benchmark::DoNotOptimize(result.first.data());
+	}
+}
+BENCHMARK(BM_detect_encoding);
+
+// Reading tokens back from a warm cache, which is the cost that
+// tokenize_cached is meant to replace tokenizing with
+static void BM_token_file(benchmark::State& state)
+{
+	const auto& source = corpus::get(int(state.range(0)));
+	state.SetLabel(corpus::names[state.range(0)]);
+	const std::string path = "tokenize_bench.tokens";
+	{
+		std::ofstream out(path, std::ios::binary);
+		tokenize_py::write_tokens(tokenize_py::tokenize_views(source), out);
+	}
+	size_t tokens = 0;
+	size_t before = allocations;
+	for (auto _ : state) {
+		tokenize_py::TokenFile file(path, source);
+		for (const auto& token : file) {
+			benchmark::DoNotOptimize(token.token.data());
+			++tokens;
+		}
+	}
+	set_counters(state, source.size(), tokens / state.iterations(), allocations - before);
+	std::remove(path.c_str());
+}
+BENCHMARK(BM_token_file)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+// A hit in the in-process cache, which costs a hash and a compare of the
+// source
+static void BM_token_cache(benchmark::State& state)
+{
+	const auto& source = corpus::get(int(state.range(0)));
+	state.SetLabel(corpus::names[state.range(0)]);
+	tokenize_py::TokenCache cache(size_t(1) << 30);
+	size_t tokens = cache.tokenize(source)->size();
+	size_t before = allocations;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(cache.tokenize(source));
+	set_counters(state, source.size(), tokens, allocations - before);
+}
+BENCHMARK(BM_token_cache)->DenseRange(0, 3)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
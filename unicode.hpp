@@ -0,0 +1,33 @@
+#pragma once
+
+// UTF-8 validation, the identifier classes of PEP 3131 and string bodies
+// Written by Dominic Price 2021, see the LICENCE file
+//
+// Runs of ASCII and of string contents are skipped 16 or 32 bytes at a time
+// with SSE2, SSE4.2 or AVX2 when the compiler targets them, and a byte at a
+// time otherwise.
+// Only non-ASCII code points are looked up in the XID tables.
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace tokenize_py
+{
+	// Returns the offset of the first byte of s which isn't part of a well
+	// formed UTF-8 sequence, or npos if there are none.
+	size_t find_invalid_utf8(std::string_view s);
+	// Decodes the UTF-8 sequence at p, returning its length or zero if it
+	// is malformed.
+	size_t decode_utf8(std::string_view s, size_t p, uint32_t& cp);
+	// Returns the end of the run of ASCII identifier characters [A-Za-z0-9_]
+	// which starts at p.
+	size_t skip_ascii_word(std::string_view s, size_t p);
+	// Returns the end of the run of string contents which starts at p, that
+	// is the first quote, backslash or newline at or after p.
+	size_t skip_string_body(std::string_view s, size_t p, char quote);
+	// Whether a code point can start or continue an identifier, as given by
+	// the XID_Start and XID_Continue properties along with the underscore.
+	bool is_xid_start(uint32_t cp);
+	bool is_xid_continue(uint32_t cp);
+} // namespace tokenize_py